@@ -0,0 +1,67 @@
+#include "arena.h"
+
+#include <assert.h>
+#include <stdalign.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+/* Most allocations are small list entries, so a chunk holds tens of
+   thousands of them and `malloc` is called very rarely. Anything larger than
+   a chunk gets a chunk of its own. */
+#define ARENA_CHUNK_SIZE (1024 * 1024)
+
+/* Everything we store in an arena is made of pointers and integers, so we
+   don't pay for `max_align_t` padding on every list entry. */
+#define ARENA_ALIGNMENT alignof(uint64_t)
+
+struct arena_chunk {
+	struct arena_chunk *next;
+	alignas(ARENA_ALIGNMENT) char data[];
+};
+
+void arena_init(struct arena *arena)
+{
+	arena->chunks = NULL;
+	arena->next = NULL;
+	arena->end = NULL;
+	arena->bytes = 0;
+}
+
+static size_t align_size(size_t size)
+{
+	return (size + ARENA_ALIGNMENT - 1) & ~(ARENA_ALIGNMENT - 1);
+}
+
+void *arena_alloc(struct arena *arena, size_t size)
+{
+	size = align_size(size);
+	if (arena->next == NULL || (size_t) (arena->end - arena->next) < size) {
+		size_t data_size = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+		struct arena_chunk *chunk = malloc(sizeof(struct arena_chunk) + data_size);
+		assert(chunk != NULL);
+		chunk->next = arena->chunks;
+		arena->chunks = chunk;
+		arena->next = chunk->data;
+		arena->end = chunk->data + data_size;
+		arena->bytes += sizeof(struct arena_chunk) + data_size;
+	}
+	void *result = arena->next;
+	arena->next += size;
+	return result;
+}
+
+size_t arena_bytes(struct arena *arena)
+{
+	return arena->bytes;
+}
+
+void arena_destroy(struct arena *arena)
+{
+	struct arena_chunk *chunk = arena->chunks;
+	while (chunk != NULL) {
+		struct arena_chunk *next = chunk->next;
+		free(chunk);
+		chunk = next;
+	}
+	arena_init(arena);
+}
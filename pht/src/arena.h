@@ -0,0 +1,22 @@
+#pragma once
+
+#include <stddef.h>
+
+/* A bump allocator that hands out memory from large chunks. Individual
+   allocations can't be freed, everything is freed at once by
+   `arena_destroy`. An arena is not thread safe, use one per thread. */
+struct arena_chunk;
+
+struct arena {
+	struct arena_chunk *chunks;
+	char *next;
+	char *end;
+	size_t bytes;
+};
+
+void arena_init(struct arena *arena);
+/* Returns `size` bytes aligned to 8 bytes. The memory is not zeroed. */
+void *arena_alloc(struct arena *arena, size_t size);
+/* Returns the total number of bytes the arena got from `malloc`. */
+size_t arena_bytes(struct arena *arena);
+void arena_destroy(struct arena *arena);
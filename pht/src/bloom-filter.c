@@ -0,0 +1,121 @@
+#include "bloom-filter.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* A block is one cache line of 512 bits. */
+#define BLOOM_FILTER_BLOCK_WORDS 8
+#define BLOOM_FILTER_BLOCK_BITS (BLOOM_FILTER_BLOCK_WORDS * 64)
+
+/* Bits set per key. Six is close to optimal for about ten bits per key once
+   the blocks' uneven load is taken into account. */
+#define BLOOM_FILTER_HASHES 6
+
+#define BLOOM_FILTER_DEFAULT_BITS_PER_KEY 10
+
+/* The table hashes are only 32 bits and their low bits already pick the
+   bucket, so they're mixed (the MurmurHash3 finalizer) before picking a
+   block and the bits within it. */
+static uint64_t mix(uint32_t hash)
+{
+	uint64_t x = hash;
+	x ^= x >> 33;
+	x *= 0xff51afd7ed558ccdull;
+	x ^= x >> 33;
+	x *= 0xc4ceb9fe1a85ec53ull;
+	x ^= x >> 33;
+	return x;
+}
+
+static uint64_t *get_block(struct bloom_filter *filter, uint64_t mixed)
+{
+	return &filter->words[(mixed & filter->block_mask) * BLOOM_FILTER_BLOCK_WORDS];
+}
+
+/* Sets the key's bits in `masks`, one mask per word of its block. The bit
+   positions come from double hashing with the upper half of `mixed`, which
+   the block index doesn't use. */
+static void get_masks(uint64_t mixed, uint64_t masks[BLOOM_FILTER_BLOCK_WORDS])
+{
+	uint32_t h1 = mixed >> 32;
+	uint32_t h2 = (uint32_t) (mixed >> 41) | 1;
+	memset(masks, 0, BLOOM_FILTER_BLOCK_WORDS * sizeof(uint64_t));
+	for (uint32_t i = 0; i < BLOOM_FILTER_HASHES; ++i) {
+		uint32_t bit = (h1 + i * h2) % BLOOM_FILTER_BLOCK_BITS;
+		masks[bit / 64] |= 1ull << (bit % 64);
+	}
+}
+
+void bloom_filter_init(struct bloom_filter *filter, size_t capacity, uint32_t bits_per_key)
+{
+	if (bits_per_key == 0) {
+		bits_per_key = BLOOM_FILTER_DEFAULT_BITS_PER_KEY;
+	}
+	uint64_t blocks_needed = ((uint64_t) capacity * bits_per_key + BLOOM_FILTER_BLOCK_BITS - 1)
+	                         / BLOOM_FILTER_BLOCK_BITS;
+	uint64_t block_count = 1;
+	while (block_count < blocks_needed) {
+		block_count *= 2;
+	}
+	size_t size = block_count * BLOOM_FILTER_BLOCK_WORDS * sizeof(uint64_t);
+	filter->words = aligned_alloc(BLOOM_FILTER_BLOCK_WORDS * sizeof(uint64_t), size);
+	assert(filter->words != NULL);
+	memset(filter->words, 0, size);
+	filter->block_mask = block_count - 1;
+}
+
+void bloom_filter_add(struct bloom_filter *filter, uint32_t hash)
+{
+	uint64_t mixed = mix(hash);
+	uint64_t *block = get_block(filter, mixed);
+	uint64_t masks[BLOOM_FILTER_BLOCK_WORDS];
+	get_masks(mixed, masks);
+	for (uint32_t i = 0; i < BLOOM_FILTER_BLOCK_WORDS; ++i) {
+		/* Skip the atomic write if the bits are already set, which keeps a
+		   busy block's cache line shared between the readers. */
+		if (masks[i] != 0
+		    && (__atomic_load_n(&block[i], __ATOMIC_RELAXED) & masks[i]) != masks[i]) {
+			__atomic_fetch_or(&block[i], masks[i], __ATOMIC_RELAXED);
+		}
+	}
+}
+
+bool bloom_filter_may_contain(struct bloom_filter *filter, uint32_t hash)
+{
+	uint64_t mixed = mix(hash);
+	uint64_t *block = get_block(filter, mixed);
+	uint64_t masks[BLOOM_FILTER_BLOCK_WORDS];
+	get_masks(mixed, masks);
+	uint64_t missing = 0;
+	for (uint32_t i = 0; i < BLOOM_FILTER_BLOCK_WORDS; ++i) {
+		missing |= masks[i] & ~__atomic_load_n(&block[i], __ATOMIC_RELAXED);
+	}
+	return missing == 0;
+}
+
+void bloom_filter_prefetch(struct bloom_filter *filter, uint32_t hash)
+{
+	__builtin_prefetch(get_block(filter, mix(hash)), 0, 3);
+}
+
+size_t bloom_filter_bytes(struct bloom_filter *filter)
+{
+	return (filter->block_mask + 1) * BLOOM_FILTER_BLOCK_WORDS * sizeof(uint64_t);
+}
+
+uint64_t bloom_filter_bits_set(struct bloom_filter *filter)
+{
+	uint64_t bits = 0;
+	size_t word_count = (filter->block_mask + 1) * BLOOM_FILTER_BLOCK_WORDS;
+	for (size_t i = 0; i < word_count; ++i) {
+		bits += __builtin_popcountll(__atomic_load_n(&filter->words[i], __ATOMIC_RELAXED));
+	}
+	return bits;
+}
+
+void bloom_filter_destroy(struct bloom_filter *filter)
+{
+	free(filter->words);
+	filter->words = NULL;
+}
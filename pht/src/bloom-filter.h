@@ -0,0 +1,33 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* A blocked Bloom filter: every key sets and tests a few bits in a single
+   cache line, so a lookup costs at most one cache miss. It answers "maybe"
+   or "no", and is never wrong about "no". Keys can't be removed.
+
+   `bloom_filter_add` and `bloom_filter_may_contain` may run concurrently
+   from any number of threads. A key is only guaranteed to be seen by lookups
+   that happen after its `bloom_filter_add` returned. */
+struct bloom_filter {
+	uint64_t *words;
+	/* The number of cache line blocks minus one, always a power of two
+	   minus one. */
+	uint64_t block_mask;
+};
+
+/* Sizes the filter for `capacity` keys at `bits_per_key` bits each, rounded
+   up to a power of two number of blocks. Ten bits per key give about a 1%
+   false-positive rate. */
+void bloom_filter_init(struct bloom_filter *filter, size_t capacity, uint32_t bits_per_key);
+void bloom_filter_add(struct bloom_filter *filter, uint32_t hash);
+bool bloom_filter_may_contain(struct bloom_filter *filter, uint32_t hash);
+/* Prefetches the block of `hash`, for the batch calls. */
+void bloom_filter_prefetch(struct bloom_filter *filter, uint32_t hash);
+size_t bloom_filter_bytes(struct bloom_filter *filter);
+/* Returns the number of bits set, which gives the expected false-positive
+   rate. Not consistent while keys are being added. */
+uint64_t bloom_filter_bits_set(struct bloom_filter *filter);
+void bloom_filter_destroy(struct bloom_filter *filter);
@@ -1,5 +1,7 @@
 #include "hash-table-base.h"
 
+#include "arena.h"
+
 #include <assert.h>
 #include <stdlib.h>
 #include <string.h>
@@ -32,6 +34,11 @@ struct hash_table_entry {
    your `hash_table_entry`. */
 struct hash_table_base {
 	struct hash_table_entry entries[HASH_TABLE_CAPACITY];
+	/* All the `list_entry` nodes are allocated from this arena, which frees
+	   them all at once when the table is destroyed. */
+	struct arena arena;
+	/* Nodes of removed entries, reused by the next inserts. */
+	struct list_head free_list;
 };
 
 /* This function uses `calloc` to allocate dynamic memory, because it will be
@@ -46,6 +53,8 @@ struct hash_table_base *hash_table_base_create()
 		struct hash_table_entry *entry = &hash_table->entries[i];
 		SLIST_INIT(&entry->list_head);
 	}
+	arena_init(&hash_table->arena);
+	SLIST_INIT(&hash_table->free_list);
 	return hash_table;
 }
 
@@ -97,8 +106,9 @@ bool hash_table_base_contains(struct hash_table_base *hash_table,
    update the value to the new value. We do not create a new entry in this
    case because the key should only be in the hash table exactly one time.
    Otherwise, we have a collision and we add it to the linked list. We allocate
-   a new list entry, which is a (key, value), and insert it to the end of the
-   linked list for this hash table entry. */
+   a new list entry, which is a (key, value), reusing a removed one if we have
+   one and otherwise taking it from the table's arena, and insert it to the
+   end of the linked list for this hash table entry. */
 void hash_table_base_add_entry(struct hash_table_base *hash_table,
                                const char *key,
                                uint32_t value)
@@ -112,7 +122,13 @@ void hash_table_base_add_entry(struct hash_table_base *hash_table,
 		return;
 	}
 
-	list_entry = calloc(1, sizeof(struct list_entry));
+	if (!SLIST_EMPTY(&hash_table->free_list)) {
+		list_entry = SLIST_FIRST(&hash_table->free_list);
+		SLIST_REMOVE_HEAD(&hash_table->free_list, pointers);
+	}
+	else {
+		list_entry = arena_alloc(&hash_table->arena, sizeof(struct list_entry));
+	}
 	list_entry->key = key;
 	list_entry->value = value;
 	SLIST_INSERT_HEAD(list_head, list_entry, pointers);
@@ -131,24 +147,30 @@ uint32_t hash_table_base_get_value(struct hash_table_base *hash_table,
 	return list_entry->value;
 }
 
-/* This function uses frees all memory our hash table uses. First it goes
-   through the linked lists for every element. To properly free all the memory
-   we free each node in the linked list, by remove removing the first node
-   from the list, freeing it, and doing that until the linked list is empty.
-   After we free all of the linked list nodes, we can free the hash table
-   itself. You should free any extra memory you use in your implementations
-   in your destory function as well. */
-void hash_table_base_destroy(struct hash_table_base *hash_table)
+/* Removes the (key, value) for this key if it's in the hash table. We find
+   the entry with our helper functions and unlink it from its list. Arena
+   memory can't be freed on its own, so the node goes on the table's free
+   list for the next insert to reuse. Returns whether the key was there. */
+bool hash_table_base_remove(struct hash_table_base *hash_table,
+                            const char *key)
 {
-	for (size_t i = 0; i < HASH_TABLE_CAPACITY; ++i) {
-		struct hash_table_entry *entry = &hash_table->entries[i];
-		struct list_head *list_head = &entry->list_head;
-		struct list_entry *list_entry = NULL;
-		while (!SLIST_EMPTY(list_head)) {
-			list_entry = SLIST_FIRST(list_head);
-			SLIST_REMOVE_HEAD(list_head, pointers);
-			free(list_entry);
-		}
+	struct list_head *list_head = get_list_head(hash_table, key);
+	struct list_entry *list_entry = get_list_entry(list_head, key);
+	if (list_entry == NULL) {
+		return false;
 	}
+	SLIST_REMOVE(list_head, list_entry, list_entry, pointers);
+	SLIST_INSERT_HEAD(&hash_table->free_list, list_entry, pointers);
+	return true;
+}
+
+/* This function frees all memory our hash table uses. The linked list nodes
+   all live in the table's arena, so instead of walking every list and freeing
+   each node we free the arena's chunks in one go. After that we can free the
+   hash table itself. You should free any extra memory you use in your
+   implementations in your destory function as well. */
+void hash_table_base_destroy(struct hash_table_base *hash_table)
+{
+	arena_destroy(&hash_table->arena);
 	free(hash_table);
 }
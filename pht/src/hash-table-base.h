@@ -24,6 +24,10 @@ bool hash_table_base_contains(struct hash_table_base *hash_table,
    not in the table this function will terminate the process. */
 uint32_t hash_table_base_get_value(struct hash_table_base *hash_table,
                                    const char* key);
+/* Removes the key from the hash table if it's there, returns whether it was
+   removed. */
+bool hash_table_base_remove(struct hash_table_base *hash_table,
+                            const char *key);
 /* Destroy a hash table, returned from `hash_table_base_create`. This function
    should free all associated memory that the hash table used. It should pass
    `valgrind` with no leaks. */
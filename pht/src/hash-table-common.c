@@ -2,6 +2,12 @@
 
 #include <stdbool.h>
 #include <stddef.h>
+#include <string.h>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#define HAVE_CRC32C_INSTRUCTION 1
+#endif
 
 uint32_t bernstein_hash(const char *string)
 {
@@ -17,3 +23,178 @@ uint32_t bernstein_hash(const char *string)
 	}
 	return hash;
 }
+
+static uint64_t read64(const uint8_t *p)
+{
+	uint64_t value;
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+static uint64_t read32(const uint8_t *p)
+{
+	uint32_t value;
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+/* Multiplies to 128 bits and folds the halves together. */
+static uint64_t mum(uint64_t a, uint64_t b)
+{
+	__uint128_t r = (__uint128_t) a * b;
+	return (uint64_t) r ^ (uint64_t) (r >> 64);
+}
+
+#define WYHASH_P0 0xa0761d6478bd642full
+#define WYHASH_P1 0xe7037ed1a0b428dbull
+#define WYHASH_P2 0x8ebc6af09c88c6e3ull
+
+/* A simplified wyhash. Keys of up to 16 bytes, which is all of the tester's,
+   are read with two (possibly overlapping) loads and mixed with one 128-bit
+   multiply instead of one dependent multiply per byte. */
+static uint32_t wyhash_hash(const char *string)
+{
+	const uint8_t *p = (const uint8_t *) string;
+	size_t length = strlen(string);
+	size_t remaining = length;
+	uint64_t seed = WYHASH_P0;
+	while (remaining > 16) {
+		seed = mum(read64(p) ^ WYHASH_P1, read64(p + 8) ^ seed);
+		p += 16;
+		remaining -= 16;
+	}
+	uint64_t a = 0;
+	uint64_t b = 0;
+	if (remaining >= 8) {
+		a = read64(p);
+		b = read64(p + remaining - 8);
+	}
+	else if (remaining >= 4) {
+		a = read32(p);
+		b = read32(p + remaining - 4);
+	}
+	else if (remaining > 0) {
+		a = ((uint64_t) p[0] << 16) | ((uint64_t) p[remaining / 2] << 8) | p[remaining - 1];
+	}
+	uint64_t hash = mum(a ^ WYHASH_P1, b ^ seed);
+	hash = mum(hash ^ WYHASH_P2, length ^ WYHASH_P1);
+	return (uint32_t) (hash ^ (hash >> 32));
+}
+
+/* The wyhash mixing without the length handling: a fixed width key is one,
+   two or four 8 byte words and nothing else. */
+static uint32_t fold(uint64_t hash)
+{
+	hash = mum(hash ^ WYHASH_P2, WYHASH_P1);
+	return (uint32_t) (hash ^ (hash >> 32));
+}
+
+static uint32_t fixed_width_8_hash(const char *string)
+{
+	const uint8_t *p = (const uint8_t *) string;
+	return fold(mum(read64(p) ^ WYHASH_P1, WYHASH_P0));
+}
+
+static uint32_t fixed_width_16_hash(const char *string)
+{
+	const uint8_t *p = (const uint8_t *) string;
+	return fold(mum(read64(p) ^ WYHASH_P1, read64(p + 8) ^ WYHASH_P0));
+}
+
+static uint32_t fixed_width_32_hash(const char *string)
+{
+	const uint8_t *p = (const uint8_t *) string;
+	uint64_t seed = mum(read64(p) ^ WYHASH_P1, read64(p + 8) ^ WYHASH_P0);
+	return fold(mum(read64(p + 16) ^ WYHASH_P1, read64(p + 24) ^ seed));
+}
+
+/* Bit at a time CRC32C (Castagnoli, reflected polynomial 0x82F63B78), for
+   CPUs without the instruction. */
+static uint32_t crc32c_software_hash(const char *string)
+{
+	uint32_t crc = 0xFFFFFFFF;
+	for (const uint8_t *p = (const uint8_t *) string; *p != 0; ++p) {
+		crc ^= *p;
+		for (int i = 0; i < 8; ++i) {
+			crc = (crc >> 1) ^ (0x82F63B78 & (0 - (crc & 1)));
+		}
+	}
+	return ~crc;
+}
+
+#ifdef HAVE_CRC32C_INSTRUCTION
+__attribute__((target("sse4.2")))
+static uint32_t crc32c_hardware_hash(const char *string)
+{
+	const uint8_t *p = (const uint8_t *) string;
+	size_t length = strlen(string);
+	uint64_t crc = 0xFFFFFFFF;
+	while (length >= 8) {
+		crc = _mm_crc32_u64(crc, read64(p));
+		p += 8;
+		length -= 8;
+	}
+	uint32_t crc32 = (uint32_t) crc;
+	while (length > 0) {
+		crc32 = _mm_crc32_u8(crc32, *p);
+		++p;
+		--length;
+	}
+	return ~crc32;
+}
+#endif
+
+hash_function_t get_hash_function(enum hash_function hash_function)
+{
+	switch (hash_function) {
+	case HASH_FUNCTION_WYHASH:
+		return wyhash_hash;
+	case HASH_FUNCTION_CRC32C:
+#ifdef HAVE_CRC32C_INSTRUCTION
+		__builtin_cpu_init();
+		if (__builtin_cpu_supports("sse4.2")) {
+			return crc32c_hardware_hash;
+		}
+#endif
+		return crc32c_software_hash;
+	default:
+		return bernstein_hash;
+	}
+}
+
+hash_function_t get_fixed_width_hash_function(uint32_t width)
+{
+	switch (width) {
+	case 8:
+		return fixed_width_8_hash;
+	case 16:
+		return fixed_width_16_hash;
+	case 32:
+		return fixed_width_32_hash;
+	default:
+		return NULL;
+	}
+}
+
+const char *get_hash_function_name(enum hash_function hash_function)
+{
+	switch (hash_function) {
+	case HASH_FUNCTION_WYHASH:
+		return "wyhash";
+	case HASH_FUNCTION_CRC32C:
+		return "crc32c";
+	default:
+		return "djb2";
+	}
+}
+
+bool parse_hash_function(const char *name, enum hash_function *hash_function)
+{
+	for (int i = 0; i < HASH_FUNCTION_COUNT; ++i) {
+		if (strcmp(name, get_hash_function_name(i)) == 0) {
+			*hash_function = i;
+			return true;
+		}
+	}
+	return false;
+}
@@ -1,5 +1,6 @@
 #pragma once
 
+#include <stdbool.h>
 #include <stdint.h>
 
 /* All of our hash tables will have the same capcity so we can create a fair
@@ -9,3 +10,29 @@
 /* We'll also use the same hash function for all our hash tables, called the
    bernstein hash. You may also find it referred to as the djb2 hash. */
 uint32_t bernstein_hash(const char *string);
+
+/* Tables that let you pick the hash function at create time take one of
+   these. The bernstein hash is 0, so zero initialized options keep it. */
+enum hash_function {
+	HASH_FUNCTION_BERNSTEIN,
+	/* wyhash style, mixes the key 8 bytes at a time with 64-bit multiplies. */
+	HASH_FUNCTION_WYHASH,
+	/* CRC32C, using the SSE4.2 `crc32` instruction when the CPU has it. */
+	HASH_FUNCTION_CRC32C,
+	HASH_FUNCTION_COUNT,
+};
+
+typedef uint32_t (*hash_function_t)(const char *string);
+
+/* Returns the implementation of `hash_function`, picking the fastest one the
+   CPU supports. */
+hash_function_t get_hash_function(enum hash_function hash_function);
+/* Returns a hash for keys that always take up exactly `width` bytes
+   (including the terminator and any zero padding after it), which reads the
+   key as whole words instead of looking for its end. Only 8, 16 and 32 are
+   supported, returns `NULL` for any other width. */
+hash_function_t get_fixed_width_hash_function(uint32_t width);
+const char *get_hash_function_name(enum hash_function hash_function);
+/* Looks up a hash function by the name `get_hash_function_name` returns.
+   Returns false if there is no hash function with this name. */
+bool parse_hash_function(const char *name, enum hash_function *hash_function);
@@ -0,0 +1,483 @@
+#include "hash-table-cuckoo.h"
+
+#include <assert.h>
+#include <sched.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Partial-key cuckoo hashing, as in MemC3. A key's first bucket is its hash
+   masked to the table size, its second one is the first XORed with a hash of
+   its 8 bit tag. Since the tag is stored in the slot, the other bucket of
+   any slot's key is known without the key, so displacing keys never rehashes
+   them and never follows a key pointer.
+
+   Every bucket is covered by one of `CUCKOO_LOCK_STRIPES` stripes. A stripe
+   is a lock and a version counter in one word: a writer makes it odd to lock
+   the stripe and even again to unlock it, so every change to a bucket
+   changes its stripe's version. Readers read the versions of both buckets,
+   the buckets, and the versions again, and retry unless nothing changed in
+   between. Writers take the stripes of both buckets involved, lower stripe
+   first.
+
+   An insert whose buckets are both full moves keys out of the way. It
+   searches breadth-first for a path of displacements ending in an empty
+   slot, then moves keys along it starting from the empty end, one key at a
+   time with both of the key's buckets locked. A moved key is written to its
+   new slot before it's cleared from the old one, so a reader never misses
+   it. If no path is found the table doubles, which takes every stripe. */
+
+#define CUCKOO_SLOTS 4
+
+#define CUCKOO_LOCK_STRIPES 1024
+
+/* The most buckets a search for a displacement path looks at. With four
+   slots per bucket this finds a path until the table is about 95% full. */
+#define CUCKOO_MAX_SEARCH 512
+
+/* A waiter yields the CPU after spinning this many times, in case the writer
+   isn't running. */
+#define CUCKOO_LOCK_SPINS 128
+
+#define CACHE_LINE_SIZE 64
+
+/* A tag of 0 marks an empty slot. Slots are written key and value first, tag
+   last, all with atomic stores, since readers look at them without a
+   lock. */
+struct cuckoo_bucket {
+	uint8_t tags[CUCKOO_SLOTS];
+	uint32_t values[CUCKOO_SLOTS];
+	const char *keys[CUCKOO_SLOTS];
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct bucket_array {
+	uint64_t mask;
+	/* The array this one replaced. Readers may still be on an old array
+	   after the table grew, so they're only freed with the table. All of
+	   them together are smaller than the current one. */
+	struct bucket_array *previous;
+	struct cuckoo_bucket buckets[];
+};
+
+struct hash_table_cuckoo {
+	struct bucket_array *array;
+	hash_function_t hash;
+	uint64_t stripes[CUCKOO_LOCK_STRIPES];
+};
+
+/* One step of a displacement path: the key in `slot` of the parent's bucket
+   (with `tag`) moves to `bucket`. The roots are the new key's buckets. */
+struct path_node {
+	uint64_t bucket;
+	int32_t parent;
+	uint8_t slot;
+	uint8_t tag;
+};
+
+static void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+static void wait_for_writer(unsigned *spins)
+{
+	if (++*spins == CUCKOO_LOCK_SPINS) {
+		*spins = 0;
+		sched_yield();
+	}
+	else {
+		cpu_relax();
+	}
+}
+
+static struct bucket_array *bucket_array_create(uint64_t bucket_count)
+{
+	size_t size = sizeof(struct bucket_array) + bucket_count * sizeof(struct cuckoo_bucket);
+	struct bucket_array *array = aligned_alloc(CACHE_LINE_SIZE, size);
+	assert(array != NULL);
+	memset(array, 0, size);
+	array->mask = bucket_count - 1;
+	return array;
+}
+
+static uint8_t get_tag(uint32_t hash)
+{
+	uint8_t tag = hash >> 24;
+	return tag != 0 ? tag : 1;
+}
+
+/* Also maps the alternate bucket back to the first one. */
+static uint64_t get_alternate_bucket(struct bucket_array *array, uint64_t bucket, uint8_t tag)
+{
+	return (bucket ^ (tag * 0x5bd1e995u)) & array->mask;
+}
+
+static uint64_t *get_stripe(struct hash_table_cuckoo *hash_table, uint64_t bucket)
+{
+	return &hash_table->stripes[bucket % CUCKOO_LOCK_STRIPES];
+}
+
+static void lock_stripe(uint64_t *stripe)
+{
+	unsigned spins = 0;
+	while (true) {
+		uint64_t version = __atomic_load_n(stripe, __ATOMIC_RELAXED);
+		if ((version & 1) == 0
+		    && __atomic_compare_exchange_n(stripe, &version, version + 1,
+		                                   true, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
+			break;
+		}
+		wait_for_writer(&spins);
+	}
+	/* Readers must see the odd version before any of our changes. */
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void unlock_stripe(uint64_t *stripe)
+{
+	uint64_t version = __atomic_load_n(stripe, __ATOMIC_RELAXED);
+	__atomic_store_n(stripe, version + 1, __ATOMIC_RELEASE);
+}
+
+static void lock_buckets(struct hash_table_cuckoo *hash_table, uint64_t first, uint64_t second)
+{
+	uint64_t *a = get_stripe(hash_table, first);
+	uint64_t *b = get_stripe(hash_table, second);
+	if (a > b) {
+		uint64_t *swap = a;
+		a = b;
+		b = swap;
+	}
+	lock_stripe(a);
+	if (b != a) {
+		lock_stripe(b);
+	}
+}
+
+static void unlock_buckets(struct hash_table_cuckoo *hash_table, uint64_t first, uint64_t second)
+{
+	uint64_t *a = get_stripe(hash_table, first);
+	uint64_t *b = get_stripe(hash_table, second);
+	unlock_stripe(a);
+	if (b != a) {
+		unlock_stripe(b);
+	}
+}
+
+static void lock_all(struct hash_table_cuckoo *hash_table)
+{
+	for (size_t i = 0; i < CUCKOO_LOCK_STRIPES; ++i) {
+		lock_stripe(&hash_table->stripes[i]);
+	}
+}
+
+static void unlock_all(struct hash_table_cuckoo *hash_table)
+{
+	for (size_t i = 0; i < CUCKOO_LOCK_STRIPES; ++i) {
+		unlock_stripe(&hash_table->stripes[i]);
+	}
+}
+
+struct hash_table_cuckoo *hash_table_cuckoo_create()
+{
+	struct hash_table_cuckoo *hash_table = calloc(1, sizeof(struct hash_table_cuckoo));
+	assert(hash_table != NULL);
+	hash_table->array = bucket_array_create(HASH_TABLE_CAPACITY);
+	/* The tag is the top 8 bits and the bucket the low bits, bernstein's
+	   top bits barely depend on the last characters. */
+	hash_table->hash = get_hash_function(HASH_FUNCTION_WYHASH);
+	return hash_table;
+}
+
+static int find_slot(struct cuckoo_bucket *bucket, uint8_t tag, const char *key)
+{
+	for (int i = 0; i < CUCKOO_SLOTS; ++i) {
+		if (__atomic_load_n(&bucket->tags[i], __ATOMIC_RELAXED) != tag) {
+			continue;
+		}
+		const char *slot_key = __atomic_load_n(&bucket->keys[i], __ATOMIC_RELAXED);
+		if (slot_key != NULL && strcmp(slot_key, key) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static int find_empty_slot(struct cuckoo_bucket *bucket)
+{
+	for (int i = 0; i < CUCKOO_SLOTS; ++i) {
+		if (__atomic_load_n(&bucket->tags[i], __ATOMIC_RELAXED) == 0) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+static void write_slot(struct cuckoo_bucket *bucket, int slot,
+                       uint8_t tag, const char *key, uint32_t value)
+{
+	__atomic_store_n(&bucket->keys[slot], key, __ATOMIC_RELAXED);
+	__atomic_store_n(&bucket->values[slot], value, __ATOMIC_RELAXED);
+	__atomic_store_n(&bucket->tags[slot], tag, __ATOMIC_RELAXED);
+}
+
+/* Searches breadth-first from the buckets `first` and `second` for a bucket
+   with an empty slot. Returns the index of that bucket's node in `nodes`, or
+   -1 if there is none within `CUCKOO_MAX_SEARCH` buckets. Runs without any
+   locks, the path is checked again as it's used. */
+static int find_path(struct bucket_array *array, uint64_t first, uint64_t second,
+                     struct path_node nodes[CUCKOO_MAX_SEARCH])
+{
+	nodes[0] = (struct path_node) { .bucket = first, .parent = -1 };
+	nodes[1] = (struct path_node) { .bucket = second, .parent = -1 };
+	int count = 2;
+	for (int i = 0; i < count; ++i) {
+		struct cuckoo_bucket *bucket = &array->buckets[nodes[i].bucket];
+		uint8_t tags[CUCKOO_SLOTS];
+		for (int slot = 0; slot < CUCKOO_SLOTS; ++slot) {
+			tags[slot] = __atomic_load_n(&bucket->tags[slot], __ATOMIC_RELAXED);
+			if (tags[slot] == 0) {
+				return i;
+			}
+		}
+		for (int slot = 0; slot < CUCKOO_SLOTS && count < CUCKOO_MAX_SEARCH; ++slot) {
+			nodes[count++] = (struct path_node) {
+				.bucket = get_alternate_bucket(array, nodes[i].bucket, tags[slot]),
+				.parent = i,
+				.slot = slot,
+				.tag = tags[slot],
+			};
+		}
+	}
+	return -1;
+}
+
+/* Moves the key of `to`'s parent slot into an empty slot of `to`'s bucket.
+   Returns false if the path is out of date: the key is gone, or the bucket
+   filled up. Whatever key holds the slot now, if it has the same tag its
+   other bucket is still `to`'s. */
+static bool move_slot(struct bucket_array *array, const struct path_node *from,
+                      const struct path_node *to)
+{
+	struct cuckoo_bucket *source = &array->buckets[from->bucket];
+	struct cuckoo_bucket *destination = &array->buckets[to->bucket];
+	if (__atomic_load_n(&source->tags[to->slot], __ATOMIC_RELAXED) != to->tag) {
+		return false;
+	}
+	int slot = find_empty_slot(destination);
+	if (slot < 0) {
+		return false;
+	}
+	write_slot(destination, slot, to->tag,
+	           __atomic_load_n(&source->keys[to->slot], __ATOMIC_RELAXED),
+	           __atomic_load_n(&source->values[to->slot], __ATOMIC_RELAXED));
+	__atomic_store_n(&source->tags[to->slot], 0, __ATOMIC_RELAXED);
+	return true;
+}
+
+/* Frees a slot in `first` or `second` by moving keys along a displacement
+   path. Returns false if there is no path and the table has to grow. Also
+   returns true if another thread changed the path under us, the caller just
+   tries again. */
+static bool make_room(struct hash_table_cuckoo *hash_table, struct bucket_array *array,
+                      uint64_t first, uint64_t second)
+{
+	struct path_node nodes[CUCKOO_MAX_SEARCH];
+	int i = find_path(array, first, second, nodes);
+	if (i < 0) {
+		return false;
+	}
+	while (nodes[i].parent >= 0) {
+		const struct path_node *to = &nodes[i];
+		const struct path_node *from = &nodes[to->parent];
+		lock_buckets(hash_table, from->bucket, to->bucket);
+		bool moved = __atomic_load_n(&hash_table->array, __ATOMIC_RELAXED) == array
+		             && move_slot(array, from, to);
+		unlock_buckets(hash_table, from->bucket, to->bucket);
+		if (!moved) {
+			break;
+		}
+		i = to->parent;
+	}
+	return true;
+}
+
+/* Inserts into an array nobody else can see yet. Returns false if there is
+   no room. */
+static bool add_entry_unlocked(struct bucket_array *array, uint32_t hash,
+                               const char *key, uint32_t value)
+{
+	uint8_t tag = get_tag(hash);
+	uint64_t first = hash & array->mask;
+	uint64_t second = get_alternate_bucket(array, first, tag);
+	struct path_node nodes[CUCKOO_MAX_SEARCH];
+	int i = find_path(array, first, second, nodes);
+	if (i < 0) {
+		return false;
+	}
+	for (; nodes[i].parent >= 0; i = nodes[i].parent) {
+		bool moved = move_slot(array, &nodes[nodes[i].parent], &nodes[i]);
+		assert(moved);
+		(void) moved;
+	}
+	struct cuckoo_bucket *bucket = &array->buckets[nodes[i].bucket];
+	write_slot(bucket, find_empty_slot(bucket), tag, key, value);
+	return true;
+}
+
+/* Doubles the table, unless another thread already replaced `array`. Every
+   stripe is locked meanwhile, so readers wait too. */
+static void grow(struct hash_table_cuckoo *hash_table, struct bucket_array *array)
+{
+	lock_all(hash_table);
+	if (hash_table->array != array) {
+		unlock_all(hash_table);
+		return;
+	}
+	uint64_t bucket_count = (array->mask + 1) * 2;
+	while (true) {
+		struct bucket_array *new_array = bucket_array_create(bucket_count);
+		bool ok = true;
+		for (uint64_t b = 0; b <= array->mask && ok; ++b) {
+			struct cuckoo_bucket *bucket = &array->buckets[b];
+			for (int slot = 0; slot < CUCKOO_SLOTS && ok; ++slot) {
+				if (bucket->tags[slot] != 0) {
+					const char *key = bucket->keys[slot];
+					ok = add_entry_unlocked(new_array, hash_table->hash(key),
+					                        key, bucket->values[slot]);
+				}
+			}
+		}
+		if (ok) {
+			new_array->previous = array;
+			__atomic_store_n(&hash_table->array, new_array, __ATOMIC_RELEASE);
+			break;
+		}
+		free(new_array);
+		bucket_count *= 2;
+	}
+	unlock_all(hash_table);
+}
+
+void hash_table_cuckoo_add_entry(struct hash_table_cuckoo *hash_table,
+                                 const char *key,
+                                 uint32_t value)
+{
+	assert(key != NULL);
+	uint32_t hash = hash_table->hash(key);
+	uint8_t tag = get_tag(hash);
+	while (true) {
+		struct bucket_array *array = __atomic_load_n(&hash_table->array, __ATOMIC_ACQUIRE);
+		uint64_t first = hash & array->mask;
+		uint64_t second = get_alternate_bucket(array, first, tag);
+		lock_buckets(hash_table, first, second);
+		/* The table may have grown while we waited for the locks. */
+		if (__atomic_load_n(&hash_table->array, __ATOMIC_RELAXED) != array) {
+			unlock_buckets(hash_table, first, second);
+			continue;
+		}
+
+		uint64_t buckets[] = { first, second };
+		for (int i = 0; i < 2; ++i) {
+			struct cuckoo_bucket *bucket = &array->buckets[buckets[i]];
+			int slot = find_slot(bucket, tag, key);
+			if (slot >= 0) {
+				__atomic_store_n(&bucket->values[slot], value, __ATOMIC_RELAXED);
+				unlock_buckets(hash_table, first, second);
+				return;
+			}
+		}
+		for (int i = 0; i < 2; ++i) {
+			struct cuckoo_bucket *bucket = &array->buckets[buckets[i]];
+			int slot = find_empty_slot(bucket);
+			if (slot >= 0) {
+				write_slot(bucket, slot, tag, key, value);
+				unlock_buckets(hash_table, first, second);
+				return;
+			}
+		}
+		unlock_buckets(hash_table, first, second);
+
+		if (!make_room(hash_table, array, first, second)) {
+			grow(hash_table, array);
+		}
+	}
+}
+
+/* Looks `key` up without locking, see the top of the file. Returns false if
+   it isn't in the table. */
+static bool find_value(struct hash_table_cuckoo *hash_table, const char *key, uint32_t *value)
+{
+	assert(key != NULL);
+	uint32_t hash = hash_table->hash(key);
+	uint8_t tag = get_tag(hash);
+	unsigned spins = 0;
+	while (true) {
+		struct bucket_array *array = __atomic_load_n(&hash_table->array, __ATOMIC_ACQUIRE);
+		uint64_t buckets[] = { hash & array->mask, 0 };
+		buckets[1] = get_alternate_bucket(array, buckets[0], tag);
+		uint64_t *stripes[] = { get_stripe(hash_table, buckets[0]), get_stripe(hash_table, buckets[1]) };
+		uint64_t versions[2];
+		for (int i = 0; i < 2; ++i) {
+			versions[i] = __atomic_load_n(stripes[i], __ATOMIC_ACQUIRE);
+		}
+		if (((versions[0] | versions[1]) & 1) != 0) {
+			wait_for_writer(&spins);
+			continue;
+		}
+
+		bool found = false;
+		for (int i = 0; i < 2 && !found; ++i) {
+			struct cuckoo_bucket *bucket = &array->buckets[buckets[i]];
+			int slot = find_slot(bucket, tag, key);
+			if (slot >= 0) {
+				*value = __atomic_load_n(&bucket->values[slot], __ATOMIC_RELAXED);
+				found = true;
+			}
+		}
+
+		/* Our reads of the buckets must happen before we check the
+		   versions again. */
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(stripes[0], __ATOMIC_RELAXED) == versions[0]
+		    && __atomic_load_n(stripes[1], __ATOMIC_RELAXED) == versions[1]
+		    && __atomic_load_n(&hash_table->array, __ATOMIC_RELAXED) == array) {
+			return found;
+		}
+	}
+}
+
+bool hash_table_cuckoo_contains(struct hash_table_cuckoo *hash_table,
+                                const char *key)
+{
+	uint32_t value;
+	return find_value(hash_table, key, &value);
+}
+
+uint32_t hash_table_cuckoo_get_value(struct hash_table_cuckoo *hash_table,
+                                     const char *key)
+{
+	uint32_t value;
+	bool found = find_value(hash_table, key, &value);
+	assert(found);
+	(void) found;
+	return value;
+}
+
+size_t hash_table_cuckoo_capacity(struct hash_table_cuckoo *hash_table)
+{
+	struct bucket_array *array = __atomic_load_n(&hash_table->array, __ATOMIC_ACQUIRE);
+	return (array->mask + 1) * CUCKOO_SLOTS;
+}
+
+void hash_table_cuckoo_destroy(struct hash_table_cuckoo *hash_table)
+{
+	struct bucket_array *array = hash_table->array;
+	while (array != NULL) {
+		struct bucket_array *previous = array->previous;
+		free(array);
+		array = previous;
+	}
+	free(hash_table);
+}
@@ -0,0 +1,28 @@
+#pragma once
+
+#include "hash-table-common.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* A concurrent cuckoo hash table. Every key has exactly two buckets of four
+   slots it can live in, so a lookup reads at most two buckets no matter how
+   the keys hash, where a v2 chain can get arbitrarily long. Lookups don't
+   lock, they validate what they read against per-bucket version counters
+   and retry if a writer got in the way.
+
+   The table starts with `HASH_TABLE_CAPACITY` buckets and doubles when an
+   insert can't make room. Like v2 by default, the table keeps the caller's
+   key pointers, so keys must outlive the table. There is no remove. */
+struct hash_table_cuckoo;
+struct hash_table_cuckoo *hash_table_cuckoo_create();
+void hash_table_cuckoo_add_entry(struct hash_table_cuckoo *hash_table,
+                                 const char *key,
+                                 uint32_t value);
+bool hash_table_cuckoo_contains(struct hash_table_cuckoo *hash_table,
+                                const char *key);
+uint32_t hash_table_cuckoo_get_value(struct hash_table_cuckoo *hash_table,
+                                     const char *key);
+/* Returns the current number of slots. */
+size_t hash_table_cuckoo_capacity(struct hash_table_cuckoo *hash_table);
+void hash_table_cuckoo_destroy(struct hash_table_cuckoo *hash_table);
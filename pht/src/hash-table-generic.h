@@ -0,0 +1,171 @@
+#pragma once
+
+#include "hash-table-common.h"
+
+#include <assert.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* A table generator for any key and value type. `HASH_TABLE_GENERIC(name,
+   key_type, value_type, hash, equal)` defines `struct name` and
+   `name_create`, `name_add_entry`, `name_contains`, `name_get_value`,
+   `name_find`, `name_size` and `name_destroy`, all `static inline`.
+
+   `hash(key)` returns a `uint64_t` and `equal(a, b)` compares two keys, both
+   can be functions or function-like macros. They are expanded into the
+   table's code, so the compiler specializes every instantiation: an integer
+   keyed table compares keys with a single instruction and never calls
+   `strcmp` or a string hash.
+
+   The layout is the same as `hash_table_v3`, open addressing with linear
+   probing over a struct of arrays, except that the hash isn't stored. A
+   table is not thread safe. Keys and values are copied into the table by
+   value, so a string keyed table keeps the caller's pointers. */
+
+/* The finalizer of MurmurHash3, every bit of the key affects every bit of
+   the hash, which linear probing needs for keys like consecutive
+   integers. */
+static inline uint64_t hash_table_generic_hash_u64(uint64_t key)
+{
+	key ^= key >> 33;
+	key *= 0xff51afd7ed558ccdull;
+	key ^= key >> 33;
+	key *= 0xc4ceb9fe1a85ec53ull;
+	key ^= key >> 33;
+	return key;
+}
+
+static inline uint64_t hash_table_generic_hash_string(const char *key)
+{
+	return bernstein_hash(key);
+}
+
+#define HASH_TABLE_GENERIC_EQUAL(a, b) ((a) == (b))
+#define HASH_TABLE_GENERIC_EQUAL_STRING(a, b) (strcmp((a), (b)) == 0)
+
+/* A fingerprint of 0 marks an empty slot. The index uses the low bits of the
+   hash, the fingerprint the 7 bits above the lowest 25. */
+#define HASH_TABLE_GENERIC_FINGERPRINT(hash) ((uint8_t) (0x80 | (((hash) >> 25) & 0x7F)))
+
+#define HASH_TABLE_GENERIC(name, key_type, value_type, hash, equal) \
+	struct name { \
+		size_t capacity; \
+		size_t size; \
+		uint8_t *fingerprints; \
+		key_type *keys; \
+		value_type *values; \
+	}; \
+	\
+	static inline void name##_allocate_slots(struct name *hash_table, size_t capacity) \
+	{ \
+		hash_table->capacity = capacity; \
+		hash_table->fingerprints = calloc(capacity, sizeof(uint8_t)); \
+		hash_table->keys = malloc(capacity * sizeof(key_type)); \
+		hash_table->values = malloc(capacity * sizeof(value_type)); \
+		assert(hash_table->fingerprints != NULL); \
+		assert(hash_table->keys != NULL); \
+		assert(hash_table->values != NULL); \
+	} \
+	\
+	static inline struct name *name##_create(void) \
+	{ \
+		struct name *hash_table = calloc(1, sizeof(struct name)); \
+		assert(hash_table != NULL); \
+		name##_allocate_slots(hash_table, HASH_TABLE_CAPACITY); \
+		return hash_table; \
+	} \
+	\
+	/* Returns the slot holding `key`, or the empty slot where it would be \
+	   inserted. */ \
+	static inline size_t name##_find_slot(struct name *hash_table, key_type key, uint64_t key_hash) \
+	{ \
+		size_t mask = hash_table->capacity - 1; \
+		uint8_t fingerprint = HASH_TABLE_GENERIC_FINGERPRINT(key_hash); \
+		size_t i = key_hash & mask; \
+		while (true) { \
+			uint8_t current = hash_table->fingerprints[i]; \
+			if (current == 0) { \
+				return i; \
+			} \
+			if (current == fingerprint && equal(hash_table->keys[i], key)) { \
+				return i; \
+			} \
+			i = (i + 1) & mask; \
+		} \
+	} \
+	\
+	static inline void name##_grow(struct name *hash_table) \
+	{ \
+		struct name old = *hash_table; \
+		name##_allocate_slots(hash_table, old.capacity * 2); \
+		size_t mask = hash_table->capacity - 1; \
+		for (size_t i = 0; i < old.capacity; ++i) { \
+			if (old.fingerprints[i] == 0) { \
+				continue; \
+			} \
+			size_t j = hash(old.keys[i]) & mask; \
+			while (hash_table->fingerprints[j] != 0) { \
+				j = (j + 1) & mask; \
+			} \
+			hash_table->fingerprints[j] = old.fingerprints[i]; \
+			hash_table->keys[j] = old.keys[i]; \
+			hash_table->values[j] = old.values[i]; \
+		} \
+		free(old.fingerprints); \
+		free(old.keys); \
+		free(old.values); \
+	} \
+	\
+	static inline void name##_add_entry(struct name *hash_table, key_type key, value_type value) \
+	{ \
+		uint64_t key_hash = hash(key); \
+		size_t i = name##_find_slot(hash_table, key, key_hash); \
+		if (hash_table->fingerprints[i] != 0) { \
+			hash_table->values[i] = value; \
+			return; \
+		} \
+		/* Grow at 7/8 full, like v3. */ \
+		if ((hash_table->size + 1) * 8 > hash_table->capacity * 7) { \
+			name##_grow(hash_table); \
+			i = name##_find_slot(hash_table, key, key_hash); \
+		} \
+		hash_table->fingerprints[i] = HASH_TABLE_GENERIC_FINGERPRINT(key_hash); \
+		hash_table->keys[i] = key; \
+		hash_table->values[i] = value; \
+		++hash_table->size; \
+	} \
+	\
+	/* Returns a pointer to the value of `key`, or `NULL`. The pointer is \
+	   valid until the next `add_entry`. */ \
+	static inline value_type *name##_find(struct name *hash_table, key_type key) \
+	{ \
+		size_t i = name##_find_slot(hash_table, key, hash(key)); \
+		return hash_table->fingerprints[i] != 0 ? &hash_table->values[i] : NULL; \
+	} \
+	\
+	static inline bool name##_contains(struct name *hash_table, key_type key) \
+	{ \
+		return name##_find(hash_table, key) != NULL; \
+	} \
+	\
+	static inline value_type name##_get_value(struct name *hash_table, key_type key) \
+	{ \
+		value_type *value = name##_find(hash_table, key); \
+		assert(value != NULL); \
+		return *value; \
+	} \
+	\
+	static inline size_t name##_size(struct name *hash_table) \
+	{ \
+		return hash_table->size; \
+	} \
+	\
+	static inline void name##_destroy(struct name *hash_table) \
+	{ \
+		free(hash_table->fingerprints); \
+		free(hash_table->keys); \
+		free(hash_table->values); \
+		free(hash_table); \
+	}
@@ -0,0 +1,369 @@
+#include "hash-table-resizable.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+
+/* A chained hash table like v2, except the number of buckets starts at
+   `HASH_TABLE_CAPACITY` and doubles whenever the average chain length goes
+   over `MAX_LOAD_FACTOR`. Growing only allocates the new bucket array, the
+   entries are moved over a few buckets at a time by the operations that
+   follow, so no single insert pays for rehashing the whole table.
+
+   While a migration is in progress a key lives in the old array until its
+   old bucket has been migrated, and in the new array afterwards. Every
+   bucket has a mutex and a `migrated` flag that is only changed with that
+   mutex held, so holding an old bucket's lock pins where its keys live.
+
+   Operations don't take a table-wide lock. They load `first`, lock the
+   key's bucket there, and if it was migrated move on to the key's bucket
+   in the array's `next`, until they find one that wasn't. `resize_lock` is
+   only taken to start and to finish a migration. An operation may still be
+   on an array after the migration from it finished, so arrays are only
+   freed with the table. All of them together are smaller than the current
+   one. */
+
+#define MAX_LOAD_FACTOR 1
+
+/* The size is counted in this many counters, each on its own cache line,
+   so inserts don't all increment the same one. */
+#define SIZE_STRIPES 16
+
+#define CACHE_LINE_SIZE 64
+
+/* How many old buckets each operation migrates. This has to be enough to
+   finish a migration before the table needs to grow again: after growing to
+   2N buckets we have N old buckets to move and at least N inserts to go. */
+#define MIGRATE_BUCKETS_PER_OPERATION 4
+
+struct list_entry {
+	const char *key;
+	/* Stored so migrating an entry doesn't need to rehash its key. */
+	uint32_t hash;
+	uint32_t value;
+	SLIST_ENTRY(list_entry) pointers;
+};
+
+SLIST_HEAD(list_head, list_entry);
+
+struct hash_table_entry {
+	struct list_head list_head;
+	pthread_mutex_t mutex;
+	bool migrated;
+};
+
+struct bucket_array {
+	size_t capacity;
+	struct hash_table_entry *entries;
+	/* The array twice as large this one is migrated to, set before the
+	   migration starts. */
+	struct bucket_array *next;
+	/* Next bucket to hand out to an operation to migrate. */
+	size_t migrate_next;
+	/* How many buckets are fully migrated. */
+	size_t migrate_done;
+};
+
+struct size_stripe {
+	size_t count;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+struct hash_table_resizable {
+	struct size_stripe sizes[SIZE_STRIPES];
+	pthread_mutex_t resize_lock;
+	/* The array operations start from: the one we are migrating from
+	   during a migration, the current one otherwise. */
+	struct bucket_array *first;
+	struct bucket_array *current;
+	/* The array we are migrating from, or `NULL` if not migrating. */
+	struct bucket_array *old;
+	/* The array the table started with, every later one is reached from it
+	   through `next`. */
+	struct bucket_array *arrays;
+};
+
+static struct bucket_array *bucket_array_create(size_t capacity)
+{
+	struct bucket_array *array = calloc(1, sizeof(struct bucket_array));
+	assert(array != NULL);
+	array->capacity = capacity;
+	array->entries = calloc(capacity, sizeof(struct hash_table_entry));
+	assert(array->entries != NULL);
+	for (size_t i = 0; i < capacity; ++i) {
+		struct hash_table_entry *entry = &array->entries[i];
+		SLIST_INIT(&entry->list_head);
+		pthread_mutex_init(&entry->mutex, NULL);
+	}
+	return array;
+}
+
+/* Frees the bucket array and its list entries. A fully migrated array has
+   empty lists. */
+static void bucket_array_destroy(struct bucket_array *array)
+{
+	for (size_t i = 0; i < array->capacity; ++i) {
+		struct hash_table_entry *entry = &array->entries[i];
+		struct list_head *list_head = &entry->list_head;
+		struct list_entry *list_entry = NULL;
+		while (!SLIST_EMPTY(list_head)) {
+			list_entry = SLIST_FIRST(list_head);
+			SLIST_REMOVE_HEAD(list_head, pointers);
+			free(list_entry);
+		}
+		pthread_mutex_destroy(&entry->mutex);
+	}
+	free(array->entries);
+	free(array);
+}
+
+struct hash_table_resizable *hash_table_resizable_create()
+{
+	struct hash_table_resizable *hash_table = aligned_alloc(CACHE_LINE_SIZE,
+	                                                        sizeof(struct hash_table_resizable));
+	assert(hash_table != NULL);
+	memset(hash_table, 0, sizeof(struct hash_table_resizable));
+	pthread_mutex_init(&hash_table->resize_lock, NULL);
+	hash_table->arrays = bucket_array_create(HASH_TABLE_CAPACITY);
+	hash_table->first = hash_table->arrays;
+	hash_table->current = hash_table->arrays;
+	return hash_table;
+}
+
+/* Moves every entry of an old bucket to the next array. The capacity is a
+   power of two, so old bucket `i` only splits into new buckets `i` and
+   `i + old->capacity`. Locks are always taken old before new. The next
+   array's buckets can't be migrated yet, the table only grows again once
+   this migration is finished. */
+static void migrate_bucket(struct bucket_array *old, size_t index)
+{
+	struct bucket_array *current = old->next;
+	struct hash_table_entry *old_entry = &old->entries[index];
+
+	pthread_mutex_lock(&old_entry->mutex);
+	struct list_head *old_head = &old_entry->list_head;
+	while (!SLIST_EMPTY(old_head)) {
+		struct list_entry *list_entry = SLIST_FIRST(old_head);
+		SLIST_REMOVE_HEAD(old_head, pointers);
+		size_t new_index = list_entry->hash & (current->capacity - 1);
+		struct hash_table_entry *new_entry = &current->entries[new_index];
+		pthread_mutex_lock(&new_entry->mutex);
+		SLIST_INSERT_HEAD(&new_entry->list_head, list_entry, pointers);
+		pthread_mutex_unlock(&new_entry->mutex);
+	}
+	old_entry->migrated = true;
+	pthread_mutex_unlock(&old_entry->mutex);
+
+	__atomic_fetch_add(&old->migrate_done, 1, __ATOMIC_RELEASE);
+}
+
+/* The counters are per array, so a thread that loaded `old` just before
+   the migration finished finds nothing left to hand out. */
+static void help_migrate(struct hash_table_resizable *hash_table)
+{
+	struct bucket_array *old = __atomic_load_n(&hash_table->old, __ATOMIC_ACQUIRE);
+	if (old == NULL) {
+		return;
+	}
+	for (int i = 0; i < MIGRATE_BUCKETS_PER_OPERATION; ++i) {
+		size_t index = __atomic_fetch_add(&old->migrate_next, 1, __ATOMIC_RELAXED);
+		if (index >= old->capacity) {
+			return;
+		}
+		migrate_bucket(old, index);
+	}
+}
+
+/* Returns the locked bucket that currently owns keys with this hash. A
+   bucket is only marked migrated after `next` was set, and we read the mark
+   under the bucket's lock, so `next` is always there when we need it. */
+static struct hash_table_entry *lock_hash_table_entry(struct hash_table_resizable *hash_table,
+                                                      uint32_t hash)
+{
+	struct bucket_array *array = __atomic_load_n(&hash_table->first, __ATOMIC_ACQUIRE);
+	while (true) {
+		struct hash_table_entry *entry = &array->entries[hash & (array->capacity - 1)];
+		pthread_mutex_lock(&entry->mutex);
+		if (!entry->migrated) {
+			return entry;
+		}
+		pthread_mutex_unlock(&entry->mutex);
+		array = __atomic_load_n(&array->next, __ATOMIC_ACQUIRE);
+	}
+}
+
+static struct list_entry *get_list_entry(struct list_head *list_head,
+                                         const char *key,
+                                         uint32_t hash)
+{
+	struct list_entry *entry = NULL;
+
+	SLIST_FOREACH(entry, list_head, pointers) {
+		if (entry->hash == hash && strcmp(entry->key, key) == 0) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+/* Starts migrating to a bucket array twice as large, unless another thread
+   beat us to it or a migration is still running. Operations keep starting
+   from the old array, `next` takes them to the new one. */
+static void grow(struct hash_table_resizable *hash_table, size_t size)
+{
+	pthread_mutex_lock(&hash_table->resize_lock);
+	struct bucket_array *current = hash_table->current;
+	if (hash_table->old == NULL && size > current->capacity * MAX_LOAD_FACTOR) {
+		struct bucket_array *next = bucket_array_create(current->capacity * 2);
+		__atomic_store_n(&current->next, next, __ATOMIC_RELEASE);
+		__atomic_store_n(&hash_table->current, next, __ATOMIC_RELEASE);
+		__atomic_store_n(&hash_table->old, current, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&hash_table->resize_lock);
+}
+
+/* Lets operations start from the new array once every bucket of the old one
+   has been migrated. */
+static void finish_migration(struct hash_table_resizable *hash_table)
+{
+	pthread_mutex_lock(&hash_table->resize_lock);
+	struct bucket_array *old = hash_table->old;
+	if (old != NULL && __atomic_load_n(&old->migrate_done, __ATOMIC_ACQUIRE) == old->capacity) {
+		__atomic_store_n(&hash_table->first, hash_table->current, __ATOMIC_RELEASE);
+		__atomic_store_n(&hash_table->old, NULL, __ATOMIC_RELEASE);
+	}
+	pthread_mutex_unlock(&hash_table->resize_lock);
+}
+
+/* Runs after an operation unlocked its bucket, to grow or finish a
+   migration if the operation noticed it was needed. */
+enum follow_up {
+	FOLLOW_UP_NONE,
+	FOLLOW_UP_GROW,
+	FOLLOW_UP_FINISH_MIGRATION,
+};
+
+/* `size` is 0 for lookups, which never grow the table. */
+static enum follow_up get_follow_up(struct hash_table_resizable *hash_table,
+                                    size_t size)
+{
+	struct bucket_array *old = __atomic_load_n(&hash_table->old, __ATOMIC_ACQUIRE);
+	if (old == NULL) {
+		struct bucket_array *current = __atomic_load_n(&hash_table->current, __ATOMIC_ACQUIRE);
+		if (size > current->capacity * MAX_LOAD_FACTOR) {
+			return FOLLOW_UP_GROW;
+		}
+	}
+	else if (__atomic_load_n(&old->migrate_done, __ATOMIC_ACQUIRE) == old->capacity) {
+		return FOLLOW_UP_FINISH_MIGRATION;
+	}
+	return FOLLOW_UP_NONE;
+}
+
+static void run_follow_up(struct hash_table_resizable *hash_table,
+                          enum follow_up follow_up,
+                          size_t size)
+{
+	switch (follow_up) {
+	case FOLLOW_UP_GROW:
+		grow(hash_table, size);
+		break;
+	case FOLLOW_UP_FINISH_MIGRATION:
+		finish_migration(hash_table);
+		break;
+	case FOLLOW_UP_NONE:
+		break;
+	}
+}
+
+void hash_table_resizable_add_entry(struct hash_table_resizable *hash_table,
+                                    const char *key,
+                                    uint32_t value)
+{
+	assert(key != NULL);
+	uint32_t hash = bernstein_hash(key);
+
+	help_migrate(hash_table);
+
+	struct hash_table_entry *hash_table_entry = lock_hash_table_entry(hash_table, hash);
+	struct list_head *list_head = &hash_table_entry->list_head;
+	struct list_entry *list_entry = get_list_entry(list_head, key, hash);
+
+	/* Update the value if it already exists */
+	if (list_entry != NULL) {
+		list_entry->value = value;
+		pthread_mutex_unlock(&hash_table_entry->mutex);
+		return;
+	}
+
+	list_entry = calloc(1, sizeof(struct list_entry));
+	list_entry->key = key;
+	list_entry->hash = hash;
+	list_entry->value = value;
+	SLIST_INSERT_HEAD(list_head, list_entry, pointers);
+	pthread_mutex_unlock(&hash_table_entry->mutex);
+
+	/* Hashes are spread evenly over the counters, so one counter times
+	   their number is close enough to the size to decide when to grow. */
+	struct size_stripe *stripe = &hash_table->sizes[hash % SIZE_STRIPES];
+	size_t size = __atomic_add_fetch(&stripe->count, 1, __ATOMIC_RELAXED) * SIZE_STRIPES;
+	run_follow_up(hash_table, get_follow_up(hash_table, size), size);
+}
+
+/* Lookups take the bucket lock, since a migration may be moving the entries
+   they are walking. They also help with the migration. */
+static bool find_value(struct hash_table_resizable *hash_table,
+                       const char *key,
+                       uint32_t *value)
+{
+	assert(key != NULL);
+	uint32_t hash = bernstein_hash(key);
+
+	help_migrate(hash_table);
+
+	struct hash_table_entry *hash_table_entry = lock_hash_table_entry(hash_table, hash);
+	struct list_entry *list_entry = get_list_entry(&hash_table_entry->list_head, key, hash);
+	bool found = list_entry != NULL;
+	if (found) {
+		*value = list_entry->value;
+	}
+	pthread_mutex_unlock(&hash_table_entry->mutex);
+
+	run_follow_up(hash_table, get_follow_up(hash_table, 0), 0);
+	return found;
+}
+
+bool hash_table_resizable_contains(struct hash_table_resizable *hash_table,
+                                   const char *key)
+{
+	uint32_t value;
+	return find_value(hash_table, key, &value);
+}
+
+uint32_t hash_table_resizable_get_value(struct hash_table_resizable *hash_table,
+                                        const char *key)
+{
+	uint32_t value = 0;
+	bool found = find_value(hash_table, key, &value);
+	assert(found);
+	(void) found;
+	return value;
+}
+
+size_t hash_table_resizable_capacity(struct hash_table_resizable *hash_table)
+{
+	return __atomic_load_n(&hash_table->current, __ATOMIC_ACQUIRE)->capacity;
+}
+
+void hash_table_resizable_destroy(struct hash_table_resizable *hash_table)
+{
+	struct bucket_array *array = hash_table->arrays;
+	while (array != NULL) {
+		struct bucket_array *next = array->next;
+		bucket_array_destroy(array);
+		array = next;
+	}
+	pthread_mutex_destroy(&hash_table->resize_lock);
+	free(hash_table);
+}
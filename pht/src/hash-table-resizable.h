@@ -0,0 +1,19 @@
+#pragma once
+
+#include "hash-table-common.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct hash_table_resizable;
+struct hash_table_resizable *hash_table_resizable_create();
+void hash_table_resizable_add_entry(struct hash_table_resizable *hash_table,
+                                    const char *key,
+                                    uint32_t value);
+bool hash_table_resizable_contains(struct hash_table_resizable *hash_table,
+                                   const char *key);
+uint32_t hash_table_resizable_get_value(struct hash_table_resizable *hash_table,
+                                        const char* key);
+/* Returns the current number of buckets, which doubles as the table grows. */
+size_t hash_table_resizable_capacity(struct hash_table_resizable *hash_table);
+void hash_table_resizable_destroy(struct hash_table_resizable *hash_table);
@@ -0,0 +1,218 @@
+#include "hash-table-sharded.h"
+
+#include "hash-table-swiss.h"
+#include "hash-table-v3.h"
+
+#include <assert.h>
+#include <pthread.h>
+#include <stdlib.h>
+
+/* Every inserting thread owns a shard, so inserts take no locks and never
+   share a cache line with another thread. A key's partition is picked by a
+   routing hash, and a shard is one private `hash_table_v3` per partition.
+   Until the shards are merged a lookup asks every shard, but only the one
+   table of its key's partition in each.
+
+   Merging builds one read-optimized table per partition. Every merge thread
+   builds its partitions from just those partitions' tables in every shard,
+   and, once merged, a lookup only probes the one partition. */
+
+struct merge_worker {
+	struct hash_table_sharded *hash_table;
+	/* Merges partitions `index`, `index + thread_count` and so on. */
+	uint32_t index;
+	pthread_t thread;
+};
+
+struct hash_table_sharded {
+	uint32_t shard_count;
+	uint32_t partition_count;
+	/* `shards[partition * shard_count + shard]` has the keys of
+	   `partition` inserted into `shard`. */
+	struct hash_table_v3 **shards;
+	/* Only set once a merge was started. */
+	uint32_t merge_thread_count;
+	struct hash_table_swiss **partitions;
+	struct merge_worker *merge_workers;
+	/* Merge workers that haven't finished yet. */
+	uint32_t merge_remaining;
+	/* Set once the merge workers were joined. */
+	bool merge_joined;
+	/* Set once every partition is built, lookups then only use them. */
+	bool merged;
+};
+
+struct hash_table_sharded *hash_table_sharded_create(uint32_t shard_count,
+                                                     uint32_t partition_count)
+{
+	assert(shard_count > 0);
+	assert(partition_count > 0);
+	struct hash_table_sharded *hash_table = calloc(1, sizeof(struct hash_table_sharded));
+	assert(hash_table != NULL);
+	hash_table->shard_count = shard_count;
+	hash_table->partition_count = partition_count;
+	size_t table_count = (size_t) shard_count * partition_count;
+	hash_table->shards = calloc(table_count, sizeof(struct hash_table_v3 *));
+	assert(hash_table->shards != NULL);
+	/* A shard as a whole starts as big as a single v3 table. */
+	size_t capacity = HASH_TABLE_CAPACITY / partition_count;
+	for (size_t i = 0; i < table_count; ++i) {
+		hash_table->shards[i] = hash_table_v3_create_with_capacity(capacity);
+	}
+	return hash_table;
+}
+
+static struct hash_table_v3 *get_shard_partition(struct hash_table_sharded *hash_table,
+                                                 uint32_t shard,
+                                                 uint32_t partition)
+{
+	return hash_table->shards[(size_t) partition * hash_table->shard_count + shard];
+}
+
+/* Maps the hash onto [0, partition_count). The tables inside a partition
+   use the same hash, v3 its low bits for the slot and its top 7 for the
+   fingerprint, so taking the partition straight from some of its bits
+   would make those the same for every key of a partition. The hash is
+   mixed first (murmur3's finalizer) to keep them independent. */
+static uint32_t get_partition(struct hash_table_sharded *hash_table,
+                              const char *key)
+{
+	uint32_t hash = bernstein_hash(key);
+	hash ^= hash >> 16;
+	hash *= 0x85EBCA6Bu;
+	hash ^= hash >> 13;
+	hash *= 0xC2B2AE35u;
+	hash ^= hash >> 16;
+	return ((uint64_t) hash * hash_table->partition_count) >> 32;
+}
+
+void hash_table_sharded_add_entry(struct hash_table_sharded *hash_table,
+                                  uint32_t shard,
+                                  const char *key,
+                                  uint32_t value)
+{
+	assert(shard < hash_table->shard_count);
+	assert(hash_table->merge_workers == NULL);
+	uint32_t partition = get_partition(hash_table, key);
+	hash_table_v3_add_entry(get_shard_partition(hash_table, shard, partition), key, value);
+}
+
+/* Returns the table of the shard with the highest index that has this key,
+   or `NULL`. */
+static struct hash_table_v3 *find_shard(struct hash_table_sharded *hash_table,
+                                        const char *key)
+{
+	uint32_t partition = get_partition(hash_table, key);
+	for (uint32_t i = hash_table->shard_count; i > 0; --i) {
+		struct hash_table_v3 *shard = get_shard_partition(hash_table, i - 1, partition);
+		if (hash_table_v3_contains(shard, key)) {
+			return shard;
+		}
+	}
+	return NULL;
+}
+
+bool hash_table_sharded_contains(struct hash_table_sharded *hash_table,
+                                 const char *key)
+{
+	if (__atomic_load_n(&hash_table->merged, __ATOMIC_ACQUIRE)) {
+		uint32_t partition = get_partition(hash_table, key);
+		return hash_table_swiss_contains(hash_table->partitions[partition], key);
+	}
+	return find_shard(hash_table, key) != NULL;
+}
+
+uint32_t hash_table_sharded_get_value(struct hash_table_sharded *hash_table,
+                                      const char *key)
+{
+	if (__atomic_load_n(&hash_table->merged, __ATOMIC_ACQUIRE)) {
+		uint32_t partition = get_partition(hash_table, key);
+		return hash_table_swiss_get_value(hash_table->partitions[partition], key);
+	}
+	struct hash_table_v3 *shard = find_shard(hash_table, key);
+	assert(shard != NULL);
+	return hash_table_v3_get_value(shard, key);
+}
+
+static void merge_entry(const char *key, uint32_t value, void *context)
+{
+	hash_table_swiss_add_entry(context, key, value);
+}
+
+/* Builds the worker's partitions, each only from that partition's tables.
+   Going through the shards in order means a key in a later shard overwrites
+   it from an earlier one, the same answer `find_shard` gives. The last
+   worker to finish switches lookups over to the partitions. */
+static void *run_merge_worker(void *arg)
+{
+	struct merge_worker *worker = arg;
+	struct hash_table_sharded *hash_table = worker->hash_table;
+	for (uint32_t partition = worker->index;
+	     partition < hash_table->partition_count;
+	     partition += hash_table->merge_thread_count) {
+		for (uint32_t i = 0; i < hash_table->shard_count; ++i) {
+			hash_table_v3_foreach(get_shard_partition(hash_table, i, partition),
+			                      merge_entry, hash_table->partitions[partition]);
+		}
+	}
+	if (__atomic_sub_fetch(&hash_table->merge_remaining, 1, __ATOMIC_ACQ_REL) == 0) {
+		__atomic_store_n(&hash_table->merged, true, __ATOMIC_RELEASE);
+	}
+	return NULL;
+}
+
+void hash_table_sharded_merge_start(struct hash_table_sharded *hash_table,
+                                    uint32_t thread_count)
+{
+	assert(thread_count > 0);
+	assert(hash_table->merge_workers == NULL);
+	if (thread_count > hash_table->partition_count) {
+		thread_count = hash_table->partition_count;
+	}
+	hash_table->merge_thread_count = thread_count;
+	hash_table->partitions = calloc(hash_table->partition_count, sizeof(struct hash_table_swiss *));
+	hash_table->merge_workers = calloc(thread_count, sizeof(struct merge_worker));
+	assert(hash_table->partitions != NULL);
+	assert(hash_table->merge_workers != NULL);
+	hash_table->merge_remaining = thread_count;
+	for (uint32_t i = 0; i < hash_table->partition_count; ++i) {
+		hash_table->partitions[i] = hash_table_swiss_create();
+	}
+	for (uint32_t i = 0; i < thread_count; ++i) {
+		struct merge_worker *worker = &hash_table->merge_workers[i];
+		worker->hash_table = hash_table;
+		worker->index = i;
+		int err = pthread_create(&worker->thread, NULL, run_merge_worker, worker);
+		assert(err == 0);
+		(void) err;
+	}
+}
+
+void hash_table_sharded_merge_wait(struct hash_table_sharded *hash_table)
+{
+	assert(hash_table->merge_workers != NULL);
+	if (hash_table->merge_joined) {
+		return;
+	}
+	for (uint32_t i = 0; i < hash_table->merge_thread_count; ++i) {
+		pthread_join(hash_table->merge_workers[i].thread, NULL);
+	}
+	hash_table->merge_joined = true;
+}
+
+void hash_table_sharded_destroy(struct hash_table_sharded *hash_table)
+{
+	if (hash_table->merge_workers != NULL) {
+		hash_table_sharded_merge_wait(hash_table);
+		for (uint32_t i = 0; i < hash_table->partition_count; ++i) {
+			hash_table_swiss_destroy(hash_table->partitions[i]);
+		}
+		free(hash_table->partitions);
+		free(hash_table->merge_workers);
+	}
+	for (size_t i = 0; i < (size_t) hash_table->shard_count * hash_table->partition_count; ++i) {
+		hash_table_v3_destroy(hash_table->shards[i]);
+	}
+	free(hash_table->shards);
+	free(hash_table);
+}
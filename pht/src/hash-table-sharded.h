@@ -0,0 +1,34 @@
+#pragma once
+
+#include "hash-table-common.h"
+
+#include <stdbool.h>
+
+struct hash_table_sharded;
+/* Creates a table with `shard_count` shards. Every shard must only ever be
+   written by one thread at a time, usually each inserting thread owns one.
+   Keys are split into `partition_count` partitions by a routing hash, which
+   is how many threads a merge can use, usually the core count. */
+struct hash_table_sharded *hash_table_sharded_create(uint32_t shard_count,
+                                                     uint32_t partition_count);
+void hash_table_sharded_add_entry(struct hash_table_sharded *hash_table,
+                                  uint32_t shard,
+                                  const char *key,
+                                  uint32_t value);
+/* Lookups may run concurrently with each other and with a merge, but not
+   with inserts. If more than one shard has the key, the shard with the
+   highest index wins. */
+bool hash_table_sharded_contains(struct hash_table_sharded *hash_table,
+                                 const char *key);
+uint32_t hash_table_sharded_get_value(struct hash_table_sharded *hash_table,
+                                      const char* key);
+/* Starts merging every shard into one read-optimized table per partition
+   on `thread_count` background threads, at most one per partition. Lookups
+   switch over to the merged table as soon as it's done. All inserts must be
+   finished, no more inserts are allowed after this. */
+void hash_table_sharded_merge_start(struct hash_table_sharded *hash_table,
+                                    uint32_t thread_count);
+/* Waits for a merge started with `hash_table_sharded_merge_start`. Only one
+   thread may wait for a merge. */
+void hash_table_sharded_merge_wait(struct hash_table_sharded *hash_table);
+void hash_table_sharded_destroy(struct hash_table_sharded *hash_table);
@@ -0,0 +1,355 @@
+#include "hash-table-snapshot.h"
+
+#include <assert.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+/* The file is a header followed by three sections, each 8 byte aligned:
+
+   - `bucket_count + 1` bucket offsets. The entries of bucket `b` are
+     `entries[buckets[b]]` up to (but not including) `entries[buckets[b + 1]]`,
+     so a bucket is a contiguous run instead of a linked list.
+   - `entry_count` entries, sorted by bucket.
+   - The string pool, every key followed by a 0.
+
+   `bucket_count` is a power of two, a key's bucket is its hash masked with
+   `bucket_count - 1`. */
+
+#define SNAPSHOT_MAGIC "PHTSNAP"
+#define SNAPSHOT_VERSION 1
+
+struct snapshot_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t hash;
+	uint64_t bucket_count;
+	uint64_t entry_count;
+	uint64_t buckets_offset;
+	uint64_t entries_offset;
+	uint64_t pool_offset;
+	uint64_t pool_size;
+};
+
+struct snapshot_entry {
+	uint32_t hash;
+	uint32_t value;
+	/* Offset of the key in the string pool. */
+	uint64_t key;
+};
+
+struct hash_table_snapshot_builder {
+	enum hash_function hash_function;
+	hash_function_t hash;
+	size_t count;
+	size_t capacity;
+	struct snapshot_entry *entries;
+	size_t pool_size;
+	size_t pool_capacity;
+	char *pool;
+};
+
+static size_t align8(size_t size)
+{
+	return (size + 7) & ~(size_t) 7;
+}
+
+struct hash_table_snapshot_builder *hash_table_snapshot_builder_create(enum hash_function hash)
+{
+	struct hash_table_snapshot_builder *builder = calloc(1, sizeof(struct hash_table_snapshot_builder));
+	assert(builder != NULL);
+	builder->hash_function = hash;
+	builder->hash = get_hash_function(hash);
+	return builder;
+}
+
+void hash_table_snapshot_builder_add(struct hash_table_snapshot_builder *builder,
+                                     const char *key,
+                                     uint32_t value)
+{
+	assert(key != NULL);
+	size_t length = strlen(key) + 1;
+	if (builder->pool_size + length > builder->pool_capacity) {
+		while (builder->pool_size + length > builder->pool_capacity) {
+			builder->pool_capacity = builder->pool_capacity == 0 ? 4096 : builder->pool_capacity * 2;
+		}
+		builder->pool = realloc(builder->pool, builder->pool_capacity);
+		assert(builder->pool != NULL);
+	}
+	if (builder->count == builder->capacity) {
+		builder->capacity = builder->capacity == 0 ? 256 : builder->capacity * 2;
+		builder->entries = realloc(builder->entries,
+		                           builder->capacity * sizeof(struct snapshot_entry));
+		assert(builder->entries != NULL);
+	}
+	struct snapshot_entry *entry = &builder->entries[builder->count++];
+	entry->hash = builder->hash(key);
+	entry->value = value;
+	entry->key = builder->pool_size;
+	memcpy(builder->pool + builder->pool_size, key, length);
+	builder->pool_size += length;
+}
+
+/* Load factor at most 1. */
+static uint64_t get_bucket_count(size_t entry_count)
+{
+	uint64_t bucket_count = 1;
+	while (bucket_count < entry_count) {
+		bucket_count *= 2;
+	}
+	return bucket_count;
+}
+
+static bool write_section(FILE *file, const void *data, size_t size)
+{
+	static const char padding[8];
+	if (size > 0 && fwrite(data, size, 1, file) != 1) {
+		return false;
+	}
+	size_t padding_size = align8(size) - size;
+	return padding_size == 0 || fwrite(padding, padding_size, 1, file) == 1;
+}
+
+bool hash_table_snapshot_builder_write(struct hash_table_snapshot_builder *builder,
+                                       const char *path)
+{
+	uint64_t bucket_count = get_bucket_count(builder->count);
+	uint64_t mask = bucket_count - 1;
+
+	/* A counting sort of the entries by bucket, which gives the bucket
+	   offsets on the way. */
+	uint64_t *buckets = calloc(bucket_count + 1, sizeof(uint64_t));
+	/* One extra, `malloc(0)` may return `NULL`. */
+	struct snapshot_entry *entries = malloc((builder->count + 1) * sizeof(struct snapshot_entry));
+	assert(buckets != NULL);
+	assert(entries != NULL);
+	for (size_t i = 0; i < builder->count; ++i) {
+		++buckets[(builder->entries[i].hash & mask) + 1];
+	}
+	for (uint64_t b = 0; b < bucket_count; ++b) {
+		buckets[b + 1] += buckets[b];
+	}
+	uint64_t *next = malloc(bucket_count * sizeof(uint64_t));
+	assert(next != NULL);
+	memcpy(next, buckets, bucket_count * sizeof(uint64_t));
+	for (size_t i = 0; i < builder->count; ++i) {
+		entries[next[builder->entries[i].hash & mask]++] = builder->entries[i];
+	}
+	free(next);
+
+	struct snapshot_header header = { 0 };
+	memcpy(header.magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC));
+	header.version = SNAPSHOT_VERSION;
+	header.hash = builder->hash_function;
+	header.bucket_count = bucket_count;
+	header.entry_count = builder->count;
+	header.buckets_offset = align8(sizeof(struct snapshot_header));
+	header.entries_offset = header.buckets_offset + align8((bucket_count + 1) * sizeof(uint64_t));
+	header.pool_offset = header.entries_offset + align8(builder->count * sizeof(struct snapshot_entry));
+	header.pool_size = builder->pool_size;
+
+	/* Written to a temporary file that replaces `path` only once it's
+	   complete, so a crash or a full disk never leaves half a snapshot at
+	   `path`, and a process that has the old one mapped keeps its (now
+	   unlinked) file instead of seeing it truncated under it. */
+	size_t path_length = strlen(path);
+	char *temporary_path = malloc(path_length + sizeof(".tmp"));
+	assert(temporary_path != NULL);
+	memcpy(temporary_path, path, path_length);
+	memcpy(temporary_path + path_length, ".tmp", sizeof(".tmp"));
+
+	bool ok = false;
+	FILE *file = fopen(temporary_path, "wb");
+	if (file != NULL) {
+		ok = write_section(file, &header, sizeof(header))
+		     && write_section(file, buckets, (bucket_count + 1) * sizeof(uint64_t))
+		     && write_section(file, entries, builder->count * sizeof(struct snapshot_entry))
+		     && write_section(file, builder->pool, builder->pool_size)
+		     && fflush(file) == 0
+		     && fsync(fileno(file)) == 0;
+		int err = errno;
+		if (fclose(file) != 0) {
+			ok = false;
+			err = errno;
+		}
+		if (ok && rename(temporary_path, path) != 0) {
+			ok = false;
+			err = errno;
+		}
+		if (!ok) {
+			unlink(temporary_path);
+			errno = err;
+		}
+	}
+	free(temporary_path);
+	free(buckets);
+	free(entries);
+	return ok;
+}
+
+void hash_table_snapshot_builder_destroy(struct hash_table_snapshot_builder *builder)
+{
+	free(builder->entries);
+	free(builder->pool);
+	free(builder);
+}
+
+struct hash_table_snapshot {
+	void *map;
+	size_t map_size;
+	hash_function_t hash;
+	uint64_t mask;
+	uint64_t entry_count;
+	const uint64_t *buckets;
+	const struct snapshot_entry *entries;
+	const char *pool;
+};
+
+/* Checks that the header is a snapshot's and that the sections fit in the
+   file. */
+static bool is_valid_header(const struct snapshot_header *header, size_t size)
+{
+	if (size < sizeof(struct snapshot_header)
+	    || memcmp(header->magic, SNAPSHOT_MAGIC, sizeof(SNAPSHOT_MAGIC)) != 0
+	    || header->version != SNAPSHOT_VERSION
+	    || header->hash >= HASH_FUNCTION_COUNT
+	    || header->bucket_count == 0
+	    || (header->bucket_count & (header->bucket_count - 1)) != 0
+	    || header->bucket_count >= size / sizeof(uint64_t)
+	    || header->entry_count > size / sizeof(struct snapshot_entry)
+	    || header->pool_size > size
+	    || header->buckets_offset > size
+	    || header->entries_offset > size
+	    || header->pool_offset > size
+	    || header->buckets_offset % 8 != 0
+	    || header->entries_offset % 8 != 0) {
+		return false;
+	}
+	return header->buckets_offset + (header->bucket_count + 1) * sizeof(uint64_t) <= size
+	       && header->entries_offset + header->entry_count * sizeof(struct snapshot_entry) <= size
+	       && header->pool_offset + header->pool_size <= size;
+}
+
+/* Checks everything a lookup relies on without checking it again: the bucket
+   offsets only ever point into `entries`, every key starts in the pool, and
+   the pool ends with a terminator, so `strcmp` never runs off the end of the
+   mapping. A truncated or corrupt file is rejected here, once, instead of
+   crashing a lookup later. */
+static bool is_valid_contents(const struct snapshot_header *header,
+                              const uint64_t *buckets,
+                              const struct snapshot_entry *entries,
+                              const char *pool)
+{
+	if (buckets[0] != 0 || buckets[header->bucket_count] != header->entry_count) {
+		return false;
+	}
+	for (uint64_t b = 0; b < header->bucket_count; ++b) {
+		if (buckets[b + 1] < buckets[b]) {
+			return false;
+		}
+	}
+	for (uint64_t i = 0; i < header->entry_count; ++i) {
+		if (entries[i].key >= header->pool_size) {
+			return false;
+		}
+	}
+	return header->pool_size == 0 || pool[header->pool_size - 1] == '\0';
+}
+
+struct hash_table_snapshot *hash_table_snapshot_open_mmap(const char *path)
+{
+	int fd = open(path, O_RDONLY);
+	if (fd < 0) {
+		return NULL;
+	}
+	struct stat stat;
+	if (fstat(fd, &stat) != 0) {
+		int err = errno;
+		close(fd);
+		errno = err;
+		return NULL;
+	}
+	size_t size = stat.st_size;
+	void *map = size == 0 ? MAP_FAILED : mmap(NULL, size, PROT_READ, MAP_SHARED, fd, 0);
+	int err = errno;
+	/* The mapping stays valid without the descriptor. */
+	close(fd);
+	if (map == MAP_FAILED) {
+		errno = size == 0 ? EINVAL : err;
+		return NULL;
+	}
+
+	const struct snapshot_header *header = map;
+	if (!is_valid_header(header, size)) {
+		munmap(map, size);
+		errno = EINVAL;
+		return NULL;
+	}
+	const uint64_t *buckets = (const uint64_t *) ((const char *) map + header->buckets_offset);
+	const struct snapshot_entry *entries =
+		(const struct snapshot_entry *) ((const char *) map + header->entries_offset);
+	const char *pool = (const char *) map + header->pool_offset;
+	if (!is_valid_contents(header, buckets, entries, pool)) {
+		munmap(map, size);
+		errno = EINVAL;
+		return NULL;
+	}
+
+	struct hash_table_snapshot *snapshot = calloc(1, sizeof(struct hash_table_snapshot));
+	assert(snapshot != NULL);
+	snapshot->map = map;
+	snapshot->map_size = size;
+	snapshot->hash = get_hash_function(header->hash);
+	snapshot->mask = header->bucket_count - 1;
+	snapshot->entry_count = header->entry_count;
+	snapshot->buckets = buckets;
+	snapshot->entries = entries;
+	snapshot->pool = pool;
+	return snapshot;
+}
+
+static const struct snapshot_entry *get_snapshot_entry(struct hash_table_snapshot *snapshot,
+                                                       const char *key)
+{
+	assert(key != NULL);
+	uint32_t hash = snapshot->hash(key);
+	uint64_t bucket = hash & snapshot->mask;
+	uint64_t end = snapshot->buckets[bucket + 1];
+	for (uint64_t i = snapshot->buckets[bucket]; i < end; ++i) {
+		const struct snapshot_entry *entry = &snapshot->entries[i];
+		if (entry->hash == hash && strcmp(snapshot->pool + entry->key, key) == 0) {
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+bool hash_table_snapshot_contains(struct hash_table_snapshot *snapshot,
+                                  const char *key)
+{
+	return get_snapshot_entry(snapshot, key) != NULL;
+}
+
+uint32_t hash_table_snapshot_get_value(struct hash_table_snapshot *snapshot,
+                                       const char *key)
+{
+	const struct snapshot_entry *entry = get_snapshot_entry(snapshot, key);
+	assert(entry != NULL);
+	return entry->value;
+}
+
+size_t hash_table_snapshot_size(struct hash_table_snapshot *snapshot)
+{
+	return snapshot->entry_count;
+}
+
+void hash_table_snapshot_close(struct hash_table_snapshot *snapshot)
+{
+	munmap(snapshot->map, snapshot->map_size);
+	free(snapshot);
+}
@@ -0,0 +1,44 @@
+#pragma once
+
+#include "hash-table-common.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+/* A snapshot is a read-only copy of a table in a single flat file. It only
+   uses offsets, never pointers, so lookups run straight on the mapped file:
+   opening one is an `mmap` no matter how many entries it has. The file is
+   in the byte order of the machine that wrote it.
+
+   Tables write snapshots with their `hash_table_*_save` calls, which go
+   through a builder. */
+
+struct hash_table_snapshot_builder;
+/* Keys are hashed with `hash`, which is stored in the snapshot so lookups
+   use the same function. */
+struct hash_table_snapshot_builder *hash_table_snapshot_builder_create(enum hash_function hash);
+/* Copies the key, so it doesn't have to outlive the builder. Every key must
+   only be added once. */
+void hash_table_snapshot_builder_add(struct hash_table_snapshot_builder *builder,
+                                     const char *key,
+                                     uint32_t value);
+/* Writes the snapshot to `path` + ".tmp" and renames it to `path` once it
+   is complete, so `path` always holds a whole snapshot, and a process that
+   has the old one mapped can keep using it. Returns false with `errno` set
+   if that failed, `path` is then left as it was. */
+bool hash_table_snapshot_builder_write(struct hash_table_snapshot_builder *builder,
+                                       const char *path);
+void hash_table_snapshot_builder_destroy(struct hash_table_snapshot_builder *builder);
+
+struct hash_table_snapshot;
+/* Maps the snapshot at `path`. Returns `NULL` with `errno` set if it can't
+   be opened, or to `EINVAL` if it isn't a snapshot or is truncated or
+   corrupt. Checking that reads the whole file once. */
+struct hash_table_snapshot *hash_table_snapshot_open_mmap(const char *path);
+bool hash_table_snapshot_contains(struct hash_table_snapshot *snapshot,
+                                  const char *key);
+uint32_t hash_table_snapshot_get_value(struct hash_table_snapshot *snapshot,
+                                       const char *key);
+/* Returns the number of entries. */
+size_t hash_table_snapshot_size(struct hash_table_snapshot *snapshot);
+void hash_table_snapshot_close(struct hash_table_snapshot *snapshot);
@@ -0,0 +1,260 @@
+#include "hash-table-swiss.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <immintrin.h>
+#define HAVE_X86_ENGINES 1
+#endif
+
+/* A "Swiss table": open addressing where the slots are split into groups of
+   16. Every slot has a control byte, which is either `CTRL_EMPTY` or the low
+   7 bits of the key's hash (`h2`). A lookup picks a group from the remaining
+   hash bits (`h1`) and compares all 16 control bytes against `h2` at once,
+   only calling `strcmp` for the slots that match. Like v3 this table is not
+   thread safe. */
+
+#define GROUP_SIZE 16
+#define CTRL_EMPTY 0x80
+
+/* Grow once the table is 7/8 full. */
+#define MAX_LOAD_NUMERATOR 7
+#define MAX_LOAD_DENOMINATOR 8
+
+/* Returns a bitmask with bit `i` set if `group[i] == byte`. */
+typedef uint32_t (*match_function)(const uint8_t *group, uint8_t byte);
+
+struct hash_table_swiss {
+	size_t group_count;
+	size_t size;
+	match_function match;
+	enum hash_table_swiss_engine engine;
+	uint8_t *ctrl;
+	uint32_t *hashes;
+	const char **keys;
+	uint32_t *values;
+};
+
+static uint32_t match_scalar(const uint8_t *group, uint8_t byte)
+{
+	uint32_t mask = 0;
+	for (uint32_t i = 0; i < GROUP_SIZE; ++i) {
+		if (group[i] == byte) {
+			mask |= 1u << i;
+		}
+	}
+	return mask;
+}
+
+#ifdef HAVE_X86_ENGINES
+__attribute__((target("sse2")))
+static uint32_t match_sse2(const uint8_t *group, uint8_t byte)
+{
+	__m128i ctrl = _mm_load_si128((const __m128i *) group);
+	__m128i match = _mm_cmpeq_epi8(ctrl, _mm_set1_epi8((char) byte));
+	return (uint32_t) _mm_movemask_epi8(match);
+}
+#endif
+
+/* Returns the engine the table will actually use. A requested engine that
+   this build or CPU can't run falls back to the scalar one, so
+   `hash_table_swiss_engine_name` always names the match function in use. */
+static enum hash_table_swiss_engine select_engine(enum hash_table_swiss_engine engine)
+{
+	if (engine == HASH_TABLE_SWISS_ENGINE_SCALAR) {
+		return HASH_TABLE_SWISS_ENGINE_SCALAR;
+	}
+#ifdef HAVE_X86_ENGINES
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2")) {
+		return HASH_TABLE_SWISS_ENGINE_SSE2;
+	}
+#endif
+	return HASH_TABLE_SWISS_ENGINE_SCALAR;
+}
+
+static match_function get_match_function(enum hash_table_swiss_engine engine)
+{
+	switch (engine) {
+#ifdef HAVE_X86_ENGINES
+	case HASH_TABLE_SWISS_ENGINE_SSE2:
+		return match_sse2;
+#endif
+	default:
+		return match_scalar;
+	}
+}
+
+static uint8_t get_h2(uint32_t hash)
+{
+	return hash & 0x7F;
+}
+
+static size_t get_h1(uint32_t hash)
+{
+	return hash >> 7;
+}
+
+static void allocate_slots(struct hash_table_swiss *hash_table,
+                           size_t group_count)
+{
+	size_t capacity = group_count * GROUP_SIZE;
+	hash_table->group_count = group_count;
+	/* The SSE2 engine uses aligned loads, so every group must start on a
+	   16 byte boundary. */
+	hash_table->ctrl = aligned_alloc(GROUP_SIZE, capacity);
+	hash_table->hashes = calloc(capacity, sizeof(uint32_t));
+	hash_table->keys = calloc(capacity, sizeof(const char *));
+	hash_table->values = calloc(capacity, sizeof(uint32_t));
+	assert(hash_table->ctrl != NULL);
+	assert(hash_table->hashes != NULL);
+	assert(hash_table->keys != NULL);
+	assert(hash_table->values != NULL);
+	memset(hash_table->ctrl, CTRL_EMPTY, capacity);
+}
+
+static void free_slots(struct hash_table_swiss *hash_table)
+{
+	free(hash_table->ctrl);
+	free(hash_table->hashes);
+	free(hash_table->keys);
+	free(hash_table->values);
+}
+
+struct hash_table_swiss *hash_table_swiss_create_with_engine(enum hash_table_swiss_engine engine)
+{
+	struct hash_table_swiss *hash_table = calloc(1, sizeof(struct hash_table_swiss));
+	assert(hash_table != NULL);
+	hash_table->engine = select_engine(engine);
+	hash_table->match = get_match_function(hash_table->engine);
+	allocate_slots(hash_table, HASH_TABLE_CAPACITY / GROUP_SIZE);
+	return hash_table;
+}
+
+struct hash_table_swiss *hash_table_swiss_create()
+{
+	return hash_table_swiss_create_with_engine(HASH_TABLE_SWISS_ENGINE_AUTO);
+}
+
+const char *hash_table_swiss_engine_name(struct hash_table_swiss *hash_table)
+{
+	switch (hash_table->engine) {
+	case HASH_TABLE_SWISS_ENGINE_SSE2:
+		return "sse2";
+	default:
+		return "scalar";
+	}
+}
+
+/* Returns the slot holding `key`, or the empty slot where it should be
+   inserted. Groups are probed in triangular order, which visits every group
+   exactly once because the group count is a power of two. Nothing is ever
+   removed, so the first group with an empty slot ends the probe. */
+static size_t find_slot(struct hash_table_swiss *hash_table,
+                        const char *key,
+                        uint32_t hash)
+{
+	size_t group_mask = hash_table->group_count - 1;
+	size_t group = get_h1(hash) & group_mask;
+	uint8_t h2 = get_h2(hash);
+	for (size_t step = 1; ; ++step) {
+		const uint8_t *ctrl = &hash_table->ctrl[group * GROUP_SIZE];
+		uint32_t match = hash_table->match(ctrl, h2);
+		while (match != 0) {
+			size_t i = group * GROUP_SIZE + __builtin_ctz(match);
+			if (hash_table->hashes[i] == hash
+			    && strcmp(hash_table->keys[i], key) == 0) {
+				return i;
+			}
+			match &= match - 1;
+		}
+		uint32_t empty = hash_table->match(ctrl, CTRL_EMPTY);
+		if (empty != 0) {
+			return group * GROUP_SIZE + __builtin_ctz(empty);
+		}
+		group = (group + step) & group_mask;
+	}
+}
+
+/* Doubles the number of groups and reinserts every entry using the stored
+   hashes. */
+static void grow(struct hash_table_swiss *hash_table)
+{
+	struct hash_table_swiss old = *hash_table;
+	allocate_slots(hash_table, old.group_count * 2);
+	size_t group_mask = hash_table->group_count - 1;
+	for (size_t i = 0; i < old.group_count * GROUP_SIZE; ++i) {
+		if (old.ctrl[i] == CTRL_EMPTY) {
+			continue;
+		}
+		uint32_t hash = old.hashes[i];
+		size_t group = get_h1(hash) & group_mask;
+		for (size_t step = 1; ; ++step) {
+			const uint8_t *ctrl = &hash_table->ctrl[group * GROUP_SIZE];
+			uint32_t empty = hash_table->match(ctrl, CTRL_EMPTY);
+			if (empty != 0) {
+				size_t j = group * GROUP_SIZE + __builtin_ctz(empty);
+				hash_table->ctrl[j] = old.ctrl[i];
+				hash_table->hashes[j] = hash;
+				hash_table->keys[j] = old.keys[i];
+				hash_table->values[j] = old.values[i];
+				break;
+			}
+			group = (group + step) & group_mask;
+		}
+	}
+	free_slots(&old);
+}
+
+bool hash_table_swiss_contains(struct hash_table_swiss *hash_table,
+                               const char *key)
+{
+	assert(key != NULL);
+	size_t i = find_slot(hash_table, key, bernstein_hash(key));
+	return hash_table->ctrl[i] != CTRL_EMPTY;
+}
+
+void hash_table_swiss_add_entry(struct hash_table_swiss *hash_table,
+                                const char *key,
+                                uint32_t value)
+{
+	assert(key != NULL);
+	uint32_t hash = bernstein_hash(key);
+	size_t i = find_slot(hash_table, key, hash);
+
+	/* Update the value if it already exists */
+	if (hash_table->ctrl[i] != CTRL_EMPTY) {
+		hash_table->values[i] = value;
+		return;
+	}
+
+	size_t capacity = hash_table->group_count * GROUP_SIZE;
+	if ((hash_table->size + 1) * MAX_LOAD_DENOMINATOR
+	    > capacity * MAX_LOAD_NUMERATOR) {
+		grow(hash_table);
+		i = find_slot(hash_table, key, hash);
+	}
+
+	hash_table->ctrl[i] = get_h2(hash);
+	hash_table->hashes[i] = hash;
+	hash_table->keys[i] = key;
+	hash_table->values[i] = value;
+	++hash_table->size;
+}
+
+uint32_t hash_table_swiss_get_value(struct hash_table_swiss *hash_table,
+                                    const char *key)
+{
+	assert(key != NULL);
+	size_t i = find_slot(hash_table, key, bernstein_hash(key));
+	assert(hash_table->ctrl[i] != CTRL_EMPTY);
+	return hash_table->values[i];
+}
+
+void hash_table_swiss_destroy(struct hash_table_swiss *hash_table)
+{
+	free_slots(hash_table);
+	free(hash_table);
+}
@@ -0,0 +1,29 @@
+#pragma once
+
+#include "hash-table-common.h"
+
+#include <stdbool.h>
+
+/* The probing engine compares a whole group of 16 control bytes at once.
+   `HASH_TABLE_SWISS_ENGINE_AUTO` picks the fastest engine the CPU supports at
+   runtime, the others force a specific engine so they can be compared. An
+   engine this build or CPU can't run falls back to the scalar one. */
+enum hash_table_swiss_engine {
+	HASH_TABLE_SWISS_ENGINE_AUTO,
+	HASH_TABLE_SWISS_ENGINE_SCALAR,
+	HASH_TABLE_SWISS_ENGINE_SSE2,
+};
+
+struct hash_table_swiss;
+struct hash_table_swiss *hash_table_swiss_create();
+struct hash_table_swiss *hash_table_swiss_create_with_engine(enum hash_table_swiss_engine engine);
+/* Returns the name of the engine the table ended up using. */
+const char *hash_table_swiss_engine_name(struct hash_table_swiss *hash_table);
+void hash_table_swiss_add_entry(struct hash_table_swiss *hash_table,
+                                const char *key,
+                                uint32_t value);
+bool hash_table_swiss_contains(struct hash_table_swiss *hash_table,
+                               const char *key);
+uint32_t hash_table_swiss_get_value(struct hash_table_swiss *hash_table,
+                                    const char* key);
+void hash_table_swiss_destroy(struct hash_table_swiss *hash_table);
@@ -1,4 +1,6 @@
-#include "hash-table-base.h"
+#include "hash-table-v1.h"
+
+#include "arena.h"
 
 #include <assert.h>
 #include <stdlib.h>
@@ -18,25 +20,56 @@ struct hash_table_entry {
 	struct list_head list_head;
 };
 
+/* Optimistic inserts that keep conflicting with removes give up after this
+   many tries and do the whole insert under `mutex`. */
+#define MAX_OPTIMISTIC_ATTEMPTS 3
+
+/* Every change to the table still happens under the one `mutex`. An
+   optimistic insert only moves the duplicate scan, which is most of the work
+   of an insert, out of the lock. Once it has the lock it checks the scan is
+   still good: inserts only ever push onto the head of a bucket, so any node
+   added since is between the current head and the head we scanned from, and
+   we check just those. A remove can unlink (and reuse) a node anywhere, so
+   every remove bumps `version` and an insert that sees it change scans
+   again. Because the scan runs concurrently with writers, links, keys and
+   values are accessed atomically. */
 struct hash_table_v1 {
 	struct hash_table_entry entries[HASH_TABLE_CAPACITY];
+	struct hash_table_v1_options options;
 	pthread_mutex_t mutex;
+	/* Bumped by every remove, only written with `mutex` held. */
+	uint64_t version;
+	/* Only used with `mutex` held. */
+	struct arena arena;
+	/* Nodes of removed entries, reused by the next inserts. Only used with
+	   `mutex` held. */
+	struct list_head free_list;
 };
 
-struct hash_table_v1 *hash_table_v1_create()
+struct hash_table_v1 *hash_table_v1_create_with_options(const struct hash_table_v1_options *options)
 {
 	struct hash_table_v1 *hash_table = calloc(1, sizeof(struct hash_table_v1));
 	assert(hash_table != NULL);
+	if (options != NULL) {
+		hash_table->options = *options;
+	}
 	for (size_t i = 0; i < HASH_TABLE_CAPACITY; ++i) {
 		struct hash_table_entry *entry = &hash_table->entries[i];
 		SLIST_INIT(&entry->list_head);
 	}
 	// initialize mutex
 	pthread_mutex_init(&hash_table->mutex, NULL);
+	arena_init(&hash_table->arena);
+	SLIST_INIT(&hash_table->free_list);
 
 	return hash_table;
 }
 
+struct hash_table_v1 *hash_table_v1_create()
+{
+	return hash_table_v1_create_with_options(NULL);
+}
+
 static struct hash_table_entry *get_hash_table_entry(struct hash_table_v1 *hash_table,
                                                      const char *key)
 {
@@ -46,19 +79,28 @@ static struct hash_table_entry *get_hash_table_entry(struct hash_table_v1 *hash_
 	return entry;
 }
 
+/* Searches the nodes from `first` up to (but not including) `last` for
+   `key`. */
+static struct list_entry *get_list_entry_between(struct list_entry *first,
+                                                 struct list_entry *last,
+                                                 const char *key)
+{
+	struct list_entry *entry = first;
+	while (entry != last && entry != NULL) {
+		if (strcmp(__atomic_load_n(&entry->key, __ATOMIC_RELAXED), key) == 0) {
+			return entry;
+		}
+		entry = __atomic_load_n(&SLIST_NEXT(entry, pointers), __ATOMIC_ACQUIRE);
+	}
+	return NULL;
+}
+
 static struct list_entry *get_list_entry(struct list_head *list_head,
                                          const char *key)
 {
 	assert(key != NULL);
-
-	struct list_entry *entry = NULL;
-	
-	SLIST_FOREACH(entry, list_head, pointers) {
-	  if (strcmp(entry->key, key) == 0) {
-	    return entry;
-	  }
-	}
-	return NULL;
+	struct list_entry *first = __atomic_load_n(&SLIST_FIRST(list_head), __ATOMIC_ACQUIRE);
+	return get_list_entry_between(first, NULL, key);
 }
 
 bool hash_table_v1_contains(struct hash_table_v1 *hash_table,
@@ -70,26 +112,91 @@ bool hash_table_v1_contains(struct hash_table_v1 *hash_table,
 	return list_entry != NULL;
 }
 
-void hash_table_v1_add_entry(struct hash_table_v1 *hash_table,
+/* Adds a new node for (key, value) at the head of the bucket. Callers hold
+   `mutex` and have checked the key isn't in the bucket. */
+static void insert_list_entry(struct hash_table_v1 *hash_table,
+                              struct list_head *list_head,
+                              const char *key,
+                              uint32_t value)
+{
+	struct list_entry *list_entry;
+	if (!SLIST_EMPTY(&hash_table->free_list)) {
+		list_entry = SLIST_FIRST(&hash_table->free_list);
+		SLIST_REMOVE_HEAD(&hash_table->free_list, pointers);
+	}
+	else {
+		list_entry = arena_alloc(&hash_table->arena, sizeof(struct list_entry));
+	}
+	/* A reused node may still be looked at by an optimistic scan. */
+	__atomic_store_n(&list_entry->key, key, __ATOMIC_RELAXED);
+	__atomic_store_n(&list_entry->value, value, __ATOMIC_RELAXED);
+	__atomic_store_n(&SLIST_NEXT(list_entry, pointers), SLIST_FIRST(list_head), __ATOMIC_RELAXED);
+	__atomic_store_n(&SLIST_FIRST(list_head), list_entry, __ATOMIC_RELEASE);
+}
+
+static void add_entry_locked(struct hash_table_v1 *hash_table,
+                             struct list_head *list_head,
                              const char *key,
                              uint32_t value)
 {
 	pthread_mutex_lock(&hash_table->mutex);
-	struct hash_table_entry *hash_table_entry = get_hash_table_entry(hash_table, key);
-	struct list_head *list_head = &hash_table_entry->list_head;
 	struct list_entry *list_entry = get_list_entry(list_head, key);
 
 	/* Update the value if it already exists */
 	if (list_entry != NULL) {
-		list_entry->value = value;
-		return;
+		__atomic_store_n(&list_entry->value, value, __ATOMIC_RELAXED);
+	}
+	else {
+		insert_list_entry(hash_table, list_head, key, value);
+	}
+	pthread_mutex_unlock(&hash_table->mutex);
+}
+
+/* Returns false if a remove got in the way and nothing was done. */
+static bool try_add_entry_optimistic(struct hash_table_v1 *hash_table,
+                                     struct list_head *list_head,
+                                     const char *key,
+                                     uint32_t value)
+{
+	uint64_t version = __atomic_load_n(&hash_table->version, __ATOMIC_ACQUIRE);
+	struct list_entry *scanned = __atomic_load_n(&SLIST_FIRST(list_head), __ATOMIC_ACQUIRE);
+	struct list_entry *list_entry = get_list_entry_between(scanned, NULL, key);
+
+	pthread_mutex_lock(&hash_table->mutex);
+	if (hash_table->version != version) {
+		pthread_mutex_unlock(&hash_table->mutex);
+		return false;
+	}
+	if (list_entry == NULL) {
+		list_entry = get_list_entry_between(SLIST_FIRST(list_head), scanned, key);
 	}
 
-	list_entry = calloc(1, sizeof(struct list_entry));
-	list_entry->key = key;
-	list_entry->value = value;
-	SLIST_INSERT_HEAD(list_head, list_entry, pointers);
+	/* Update the value if it already exists */
+	if (list_entry != NULL) {
+		__atomic_store_n(&list_entry->value, value, __ATOMIC_RELAXED);
+	}
+	else {
+		insert_list_entry(hash_table, list_head, key, value);
+	}
 	pthread_mutex_unlock(&hash_table->mutex);
+	return true;
+}
+
+void hash_table_v1_add_entry(struct hash_table_v1 *hash_table,
+                             const char *key,
+                             uint32_t value)
+{
+	struct hash_table_entry *hash_table_entry = get_hash_table_entry(hash_table, key);
+	struct list_head *list_head = &hash_table_entry->list_head;
+
+	if (hash_table->options.optimistic) {
+		for (int i = 0; i < MAX_OPTIMISTIC_ATTEMPTS; ++i) {
+			if (try_add_entry_optimistic(hash_table, list_head, key, value)) {
+				return;
+			}
+		}
+	}
+	add_entry_locked(hash_table, list_head, key, value);
 }
 
 uint32_t hash_table_v1_get_value(struct hash_table_v1 *hash_table,
@@ -99,21 +206,44 @@ uint32_t hash_table_v1_get_value(struct hash_table_v1 *hash_table,
 	struct list_head *list_head = &hash_table_entry->list_head;
 	struct list_entry *list_entry = get_list_entry(list_head, key);
 	assert(list_entry != NULL);
-	return list_entry->value;
+	return __atomic_load_n(&list_entry->value, __ATOMIC_RELAXED);
 }
 
-void hash_table_v1_destroy(struct hash_table_v1 *hash_table)
+bool hash_table_v1_remove(struct hash_table_v1 *hash_table,
+                          const char *key)
 {
-	for (size_t i = 0; i < HASH_TABLE_CAPACITY; ++i) {
-		struct hash_table_entry *entry = &hash_table->entries[i];
-		struct list_head *list_head = &entry->list_head;
-		struct list_entry *list_entry = NULL;
-		while (!SLIST_EMPTY(list_head)) {
-			list_entry = SLIST_FIRST(list_head);
-			SLIST_REMOVE_HEAD(list_head, pointers);
-			free(list_entry);
+	pthread_mutex_lock(&hash_table->mutex);
+	struct hash_table_entry *hash_table_entry = get_hash_table_entry(hash_table, key);
+	struct list_head *list_head = &hash_table_entry->list_head;
+	struct list_entry *list_entry = get_list_entry(list_head, key);
+	if (list_entry == NULL) {
+		pthread_mutex_unlock(&hash_table->mutex);
+		return false;
+	}
+	/* Same as `SLIST_REMOVE`, but with atomic stores for the optimistic
+	   scans. */
+	struct list_entry *next = SLIST_NEXT(list_entry, pointers);
+	if (SLIST_FIRST(list_head) == list_entry) {
+		__atomic_store_n(&SLIST_FIRST(list_head), next, __ATOMIC_RELEASE);
+	}
+	else {
+		struct list_entry *previous = SLIST_FIRST(list_head);
+		while (SLIST_NEXT(previous, pointers) != list_entry) {
+			previous = SLIST_NEXT(previous, pointers);
 		}
+		__atomic_store_n(&SLIST_NEXT(previous, pointers), next, __ATOMIC_RELEASE);
 	}
+	__atomic_store_n(&hash_table->version, hash_table->version + 1, __ATOMIC_RELEASE);
+	__atomic_store_n(&SLIST_NEXT(list_entry, pointers), SLIST_FIRST(&hash_table->free_list),
+	                 __ATOMIC_RELAXED);
+	SLIST_FIRST(&hash_table->free_list) = list_entry;
+	pthread_mutex_unlock(&hash_table->mutex);
+	return true;
+}
+
+void hash_table_v1_destroy(struct hash_table_v1 *hash_table)
+{
+	arena_destroy(&hash_table->arena);
 	pthread_mutex_destroy(&hash_table->mutex);
 	free(hash_table);
 }
@@ -4,8 +4,19 @@
 
 #include <stdbool.h>
 
+/* Optional behaviour selected when the table is created. A zeroed struct
+   gives the default table, where every insert holds the one table lock. */
+struct hash_table_v1_options {
+	/* Look for the key without the lock and only take it to publish the
+	   entry, falling back to doing it all under the lock after repeated
+	   conflicts with removes. A concurrent remove's key may still be read by
+	   an insert, so keys must stay valid until the table is destroyed. */
+	bool optimistic;
+};
+
 struct hash_table_v1;
 struct hash_table_v1 *hash_table_v1_create();
+struct hash_table_v1 *hash_table_v1_create_with_options(const struct hash_table_v1_options *options);
 void hash_table_v1_add_entry(struct hash_table_v1 *hash_table,
                              const char *key,
                              uint32_t value);
@@ -13,4 +24,6 @@ bool hash_table_v1_contains(struct hash_table_v1 *hash_table,
                             const char *key);
 uint32_t hash_table_v1_get_value(struct hash_table_v1 *hash_table,
                                  const char* key);
+bool hash_table_v1_remove(struct hash_table_v1 *hash_table,
+                          const char *key);
 void hash_table_v1_destroy(struct hash_table_v1 *hash_table);
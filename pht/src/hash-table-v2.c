@@ -1,124 +1,1561 @@
-#include "hash-table-base.h"
+#include "hash-table-v2.h"
+
+#include "arena.h"
+#include "bloom-filter.h"
+#include "hash-table-snapshot.h"
 
 #include <assert.h>
+#include <sched.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/queue.h>
 #include <pthread.h>
+#include <time.h>
+
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#endif
+
+/* When the table owns its keys, keys shorter than this are copied into the
+   entry itself. */
+#define INLINE_KEY_SIZE 16
 
 struct list_entry {
-	const char *key;
+	union {
+		const char *key;
+		char inline_key[INLINE_KEY_SIZE];
+	};
 	uint32_t value;
+	bool key_inline;
 	SLIST_ENTRY(list_entry) pointers;
 };
 
 SLIST_HEAD(list_head, list_entry);
 
+/* Only the list head, the bucket's lock lives in one of the lock arrays of
+   `struct hash_table_v2`. Eight buckets share a cache line, and a lookup,
+   which never locks, doesn't pull a lock into its cache. */
 struct hash_table_entry {
 	struct list_head list_head;
+};
+
+#define CACHE_LINE_SIZE 64
+
+#define DEFAULT_LOCK_STRIPES 64
+
+struct padded_mutex {
 	pthread_mutex_t mutex;
+} __attribute__((aligned(CACHE_LINE_SIZE)));
+
+/* A ticket lock: `next` hands out tickets and `owner` is the ticket that
+   holds the lock. Waiters are served in the order they arrived. */
+struct ticket_lock {
+	uint16_t next;
+	uint16_t owner;
+};
+
+/* A ticket lock waiter yields the CPU after spinning this many times, in case
+   the holder isn't running. */
+#define TICKET_LOCK_SPINS 128
+
+/* Removed entries are reclaimed with epoch-based reclamation. Readers never
+   lock, so after an entry is unlinked another thread may still be looking at
+   it. Every thread announces the global epoch while it reads the table, and
+   the global epoch only advances once every reading thread has announced the
+   current one. An entry unlinked during epoch `e` can then be reused once the
+   global epoch reaches `e + 2`, since every reader that could have seen it
+   has finished by then. We only need to keep entries from the last
+   `EPOCH_COUNT` epochs around. */
+#define EPOCH_COUNT 3
+
+/* Announced by a thread that isn't reading the table. */
+#define EPOCH_QUIESCENT 0
+
+/* Entries a thread unlinked during `epoch`, waiting to be reused. */
+struct retired_list {
+	uint64_t epoch;
+	size_t count;
+	size_t capacity;
+	struct list_entry **entries;
+};
+
+/* Counters a thread keeps with `options.stats`. Only the owning thread
+   writes them, so counting never contends. `hash_table_v2_stats` reads them
+   from other threads, so they're stored with relaxed atomics. */
+struct thread_stats {
+	uint64_t lookups;
+	uint64_t probes;
+	uint64_t max_probe_depth;
+	uint64_t lock_acquisitions;
+	uint64_t lock_contended;
+	uint64_t lock_wait_nsec;
+	uint64_t cas_failures;
+	uint64_t filter_negatives;
+	uint64_t filter_false_positives;
+	uint64_t buffer_flushes;
+	uint64_t buffer_flush_locks;
+};
+
+/* An insert waiting in a thread's buffer. */
+struct buffered_insert {
+	/* The caller's key, or `NULL` if the table owns its keys and the key
+	   was copied to `key_offset` in the buffer's key pool. */
+	const char *key;
+	size_t key_offset;
+	uint32_t hash;
+	uint32_t value;
+	/* Position in the buffer, so sorting keeps the inserts of a key in
+	   order and the last one wins. */
+	uint32_t sequence;
+	/* The lock of the key's bucket, see `get_lock_index`. */
+	uint32_t lock;
+};
+
+struct insert_buffer {
+	struct buffered_insert *inserts;
+	uint32_t count;
+	/* Open addressed index of the newest insert of every key, so looking a
+	   key up doesn't scan the whole buffer. Slots hold a position in
+	   `inserts` plus one, 0 for an empty slot, and there are at least twice
+	   as many as inserts. Cleared on every flush. */
+	uint32_t *index;
+	uint32_t index_mask;
+	char *keys;
+	size_t keys_size;
+	size_t keys_capacity;
+};
+
+/* State a thread keeps for each table it uses. Every thread allocates its
+   `list_entry` nodes from its own arena, so inserting never contends on the
+   allocator and destroying the table frees whole chunks instead of nodes. */
+struct hash_table_v2_thread {
+	pthread_t owner;
+	struct arena arena;
+	/* A node this thread allocated but didn't need, reused by its next
+	   insert. Arena memory can't be freed on its own. */
+	struct list_entry *spare;
+	/* Removed nodes that no reader can see anymore, linked through their
+	   `pointers` and reused before allocating from the arena. */
+	struct list_entry *free_list;
+	/* The epoch this thread is reading in, or `EPOCH_QUIESCENT`. */
+	uint64_t active_epoch;
+	struct retired_list retired[EPOCH_COUNT];
+	struct thread_stats stats;
+	/* Only used with `options.insert_buffer`. */
+	struct insert_buffer buffer;
+	/* Set for the state of a `foreach_partition` worker, see
+	   `acquire_walker`. `get_thread` never returns one. */
+	bool walker;
+	/* Whether a worker is using this walker state, protected by
+	   `threads_mutex`. */
+	bool walker_busy;
+	struct hash_table_v2_thread *next;
 };
 
 struct hash_table_v2 {
 	struct hash_table_entry entries[HASH_TABLE_CAPACITY];
+	struct hash_table_v2_options options;
+	hash_function_t hash;
+	/* The bucket locks. Which array is used depends on `options.lock`:
+	   `mutexes` for `HASH_TABLE_V2_LOCK_MUTEX`, `padded_mutexes` (with
+	   `lock_count` of them) for the padded and striped layouts, and
+	   `ticket_locks` for `HASH_TABLE_V2_LOCK_TICKET`. */
+	pthread_mutex_t *mutexes;
+	struct padded_mutex *padded_mutexes;
+	struct ticket_lock *ticket_locks;
+	uint32_t lock_count;
+	/* Only used if `options.filter_capacity` isn't 0. Every key is added
+	   before its entry is published. */
+	struct bloom_filter filter;
+	/* Unique for every table ever created, see `get_thread`. */
+	uint64_t id;
+	pthread_mutex_t threads_mutex;
+	/* Threads are only ever added, with a release store under
+	   `threads_mutex`, so the list can be walked without the lock. */
+	struct hash_table_v2_thread *threads;
+	/* The global epoch, starts at 1. */
+	uint64_t epoch;
 };
 
-struct hash_table_v2 *hash_table_v2_create()
+static uint64_t next_table_id = 1;
+
+/* Tables a thread used recently and its state for them, newest first, so a
+   thread that works on a few tables at once doesn't go through
+   `threads_mutex` on every call. We match tables by `id` instead of address
+   because a new table can be allocated at the address of one that was
+   destroyed. An entry of a destroyed table is never matched again. */
+#define THREAD_CACHE_SIZE 4
+
+struct cached_thread {
+	uint64_t table_id;
+	struct hash_table_v2_thread *thread;
+};
+
+static __thread struct cached_thread thread_cache[THREAD_CACHE_SIZE];
+
+/* Adds a new thread state to the table. Must hold `threads_mutex`. */
+static struct hash_table_v2_thread *create_thread(struct hash_table_v2 *hash_table,
+                                                  bool walker)
+{
+	struct hash_table_v2_thread *thread = calloc(1, sizeof(struct hash_table_v2_thread));
+	assert(thread != NULL);
+	arena_init(&thread->arena);
+	thread->walker = walker;
+	/* A walker never inserts. */
+	if (!walker && hash_table->options.insert_buffer != 0) {
+		thread->buffer.inserts = calloc(hash_table->options.insert_buffer,
+		                                sizeof(struct buffered_insert));
+		assert(thread->buffer.inserts != NULL);
+		uint32_t index_size = 2;
+		while (index_size < 2 * hash_table->options.insert_buffer) {
+			index_size *= 2;
+		}
+		thread->buffer.index = calloc(index_size, sizeof(uint32_t));
+		assert(thread->buffer.index != NULL);
+		thread->buffer.index_mask = index_size - 1;
+	}
+	thread->next = hash_table->threads;
+	__atomic_store_n(&hash_table->threads, thread, __ATOMIC_RELEASE);
+	return thread;
+}
+
+static struct hash_table_v2_thread *get_thread(struct hash_table_v2 *hash_table)
+{
+	for (size_t i = 0; i < THREAD_CACHE_SIZE; ++i) {
+		if (thread_cache[i].table_id == hash_table->id) {
+			return thread_cache[i].thread;
+		}
+	}
+
+	pthread_t self = pthread_self();
+	pthread_mutex_lock(&hash_table->threads_mutex);
+	struct hash_table_v2_thread *thread = hash_table->threads;
+	while (thread != NULL && (thread->walker || !pthread_equal(thread->owner, self))) {
+		thread = thread->next;
+	}
+	if (thread == NULL) {
+		thread = create_thread(hash_table, false);
+		thread->owner = self;
+	}
+	pthread_mutex_unlock(&hash_table->threads_mutex);
+
+	memmove(&thread_cache[1], &thread_cache[0],
+	        (THREAD_CACHE_SIZE - 1) * sizeof(struct cached_thread));
+	thread_cache[0] = (struct cached_thread) { .table_id = hash_table->id, .thread = thread };
+	return thread;
+}
+
+/* Returns thread state for a `foreach_partition` worker, which only needs
+   one to announce its epoch. Worker threads only live for one walk, so
+   instead of adding state for every one of them (the list never shrinks,
+   and every epoch advance walks it), workers hand theirs back with
+   `release_walker` and the next walk reuses it. */
+static struct hash_table_v2_thread *acquire_walker(struct hash_table_v2 *hash_table)
+{
+	pthread_mutex_lock(&hash_table->threads_mutex);
+	struct hash_table_v2_thread *thread = hash_table->threads;
+	while (thread != NULL && (!thread->walker || thread->walker_busy)) {
+		thread = thread->next;
+	}
+	if (thread == NULL) {
+		thread = create_thread(hash_table, true);
+	}
+	thread->walker_busy = true;
+	pthread_mutex_unlock(&hash_table->threads_mutex);
+	return thread;
+}
+
+static void release_walker(struct hash_table_v2 *hash_table,
+                           struct hash_table_v2_thread *thread)
+{
+	pthread_mutex_lock(&hash_table->threads_mutex);
+	thread->walker_busy = false;
+	pthread_mutex_unlock(&hash_table->threads_mutex);
+}
+
+/* Start of a read-side critical section: no entry this thread can reach
+   until `exit_epoch` will be reused. */
+static void enter_epoch(struct hash_table_v2 *hash_table,
+                        struct hash_table_v2_thread *thread)
+{
+	uint64_t epoch = __atomic_load_n(&hash_table->epoch, __ATOMIC_ACQUIRE);
+	__atomic_store_n(&thread->active_epoch, epoch, __ATOMIC_RELAXED);
+	/* The announcement has to be visible before we read any links. */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static void exit_epoch(struct hash_table_v2_thread *thread)
+{
+	__atomic_store_n(&thread->active_epoch, EPOCH_QUIESCENT, __ATOMIC_RELEASE);
+}
+
+/* Advances the global epoch if every thread that is reading has announced
+   the current one. */
+static void try_advance_epoch(struct hash_table_v2 *hash_table)
+{
+	uint64_t epoch = __atomic_load_n(&hash_table->epoch, __ATOMIC_SEQ_CST);
+	struct hash_table_v2_thread *thread = __atomic_load_n(&hash_table->threads, __ATOMIC_ACQUIRE);
+	while (thread != NULL) {
+		uint64_t active_epoch = __atomic_load_n(&thread->active_epoch, __ATOMIC_SEQ_CST);
+		if (active_epoch != EPOCH_QUIESCENT && active_epoch != epoch) {
+			return;
+		}
+		thread = thread->next;
+	}
+	__atomic_compare_exchange_n(&hash_table->epoch, &epoch, epoch + 1,
+	                            false, __ATOMIC_SEQ_CST, __ATOMIC_RELAXED);
+}
+
+static void reclaim_retired_list(struct hash_table_v2_thread *thread,
+                                 struct retired_list *retired)
+{
+	for (size_t i = 0; i < retired->count; ++i) {
+		struct list_entry *list_entry = retired->entries[i];
+		SLIST_NEXT(list_entry, pointers) = thread->free_list;
+		thread->free_list = list_entry;
+	}
+	retired->count = 0;
+}
+
+/* Moves every retired list that no reader can see anymore to the free list. */
+static void reclaim(struct hash_table_v2 *hash_table,
+                    struct hash_table_v2_thread *thread)
+{
+	uint64_t epoch = __atomic_load_n(&hash_table->epoch, __ATOMIC_ACQUIRE);
+	for (size_t i = 0; i < EPOCH_COUNT; ++i) {
+		struct retired_list *retired = &thread->retired[i];
+		if (retired->count > 0 && retired->epoch + 2 <= epoch) {
+			reclaim_retired_list(thread, retired);
+		}
+	}
+}
+
+/* Hands an entry that was just unlinked to epoch-based reclamation. */
+static void retire_list_entry(struct hash_table_v2 *hash_table,
+                              struct hash_table_v2_thread *thread,
+                              struct list_entry *list_entry)
+{
+	/* The unlink has to be visible before we read the epoch. */
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	uint64_t epoch = __atomic_load_n(&hash_table->epoch, __ATOMIC_SEQ_CST);
+	struct retired_list *retired = &thread->retired[epoch % EPOCH_COUNT];
+	/* A list from `EPOCH_COUNT` or more epochs ago is old enough to reuse. */
+	if (retired->count > 0 && retired->epoch != epoch) {
+		reclaim_retired_list(thread, retired);
+	}
+	retired->epoch = epoch;
+	if (retired->count == retired->capacity) {
+		retired->capacity = retired->capacity == 0 ? 64 : retired->capacity * 2;
+		retired->entries = realloc(retired->entries,
+		                           retired->capacity * sizeof(struct list_entry *));
+		assert(retired->entries != NULL);
+	}
+	retired->entries[retired->count++] = list_entry;
+
+	try_advance_epoch(hash_table);
+	reclaim(hash_table, thread);
+}
+
+static struct list_entry *allocate_list_entry(struct hash_table_v2_thread *thread)
+{
+	struct list_entry *list_entry = thread->spare;
+	if (list_entry != NULL) {
+		thread->spare = NULL;
+		return list_entry;
+	}
+	list_entry = thread->free_list;
+	if (list_entry != NULL) {
+		thread->free_list = SLIST_NEXT(list_entry, pointers);
+		return list_entry;
+	}
+	return arena_alloc(&thread->arena, sizeof(struct list_entry));
+}
+
+/* The number of bytes to copy when the table keeps its own copy of `key`. */
+static size_t get_key_size(struct hash_table_v2 *hash_table, const char *key)
+{
+	if (hash_table->options.key_width != 0) {
+		return hash_table->options.key_width;
+	}
+	return strlen(key) + 1;
+}
+
+/* Returns a new, unpublished entry for (key, value). If the table owns its
+   keys, short keys are copied into the entry so comparing them doesn't
+   follow a pointer, and longer ones are copied into the thread's arena. A
+   long key's copy stays in the arena until the table is destroyed, even if
+   its entry is removed.
+
+   The key goes into the filter here, before any insert can publish the
+   entry, so a lookup that finds the entry never had the filter turn it
+   away. */
+static struct list_entry *create_list_entry(struct hash_table_v2 *hash_table,
+                                            struct hash_table_v2_thread *thread,
+                                            uint32_t hash,
+                                            const char *key,
+                                            uint32_t value)
+{
+	if (hash_table->options.filter_capacity != 0) {
+		bloom_filter_add(&hash_table->filter, hash);
+	}
+	struct list_entry *list_entry = allocate_list_entry(thread);
+	list_entry->value = value;
+	list_entry->key_inline = false;
+	if (!hash_table->options.own_keys) {
+		list_entry->key = key;
+		return list_entry;
+	}
+
+	size_t size = get_key_size(hash_table, key);
+	if (size <= INLINE_KEY_SIZE) {
+		memcpy(list_entry->inline_key, key, size);
+		list_entry->key_inline = true;
+	}
+	else {
+		char *copy = arena_alloc(&thread->arena, size);
+		memcpy(copy, key, size);
+		list_entry->key = copy;
+	}
+	return list_entry;
+}
+
+static const char *get_key(const struct list_entry *list_entry)
+{
+	return list_entry->key_inline ? list_entry->inline_key : list_entry->key;
+}
+
+static uint64_t read64(const char *p)
+{
+	uint64_t value;
+	memcpy(&value, p, sizeof(value));
+	return value;
+}
+
+static bool equal16(const char *a, const char *b)
+{
+#if defined(__SSE2__)
+	__m128i x = _mm_loadu_si128((const __m128i *) a);
+	__m128i y = _mm_loadu_si128((const __m128i *) b);
+	return _mm_movemask_epi8(_mm_cmpeq_epi8(x, y)) == 0xFFFF;
+#else
+	return ((read64(a) ^ read64(b)) | (read64(a + 8) ^ read64(b + 8))) == 0;
+#endif
+}
+
+/* With a fixed key width two keys are equal if all of their bytes are, the
+   padding is zero, so there's no need to look for the terminator. The switch
+   always goes the same way for a table, so it's well predicted. */
+static bool keys_equal(struct hash_table_v2 *hash_table, const char *a, const char *b)
+{
+	switch (hash_table->options.key_width) {
+	case 8:
+		return read64(a) == read64(b);
+	case 16:
+		return equal16(a, b);
+	case 32:
+		return equal16(a, b) && equal16(a + 16, b + 16);
+	default:
+		return strcmp(a, b) == 0;
+	}
+}
+
+const char *hash_table_v2_lock_name(enum hash_table_v2_lock lock)
+{
+	switch (lock) {
+	case HASH_TABLE_V2_LOCK_PADDED:
+		return "padded";
+	case HASH_TABLE_V2_LOCK_STRIPED:
+		return "striped";
+	case HASH_TABLE_V2_LOCK_TICKET:
+		return "ticket";
+	default:
+		return "mutex";
+	}
+}
+
+bool hash_table_v2_parse_lock(const char *name, enum hash_table_v2_lock *lock)
+{
+	for (int i = 0; i < HASH_TABLE_V2_LOCK_COUNT; ++i) {
+		if (strcmp(name, hash_table_v2_lock_name(i)) == 0) {
+			*lock = i;
+			return true;
+		}
+	}
+	return false;
+}
+
+static void create_locks(struct hash_table_v2 *hash_table)
+{
+	switch (hash_table->options.lock) {
+	case HASH_TABLE_V2_LOCK_MUTEX:
+		hash_table->lock_count = HASH_TABLE_CAPACITY;
+		hash_table->mutexes = calloc(HASH_TABLE_CAPACITY, sizeof(pthread_mutex_t));
+		assert(hash_table->mutexes != NULL);
+		for (size_t i = 0; i < HASH_TABLE_CAPACITY; ++i) {
+			pthread_mutex_init(&hash_table->mutexes[i], NULL);
+		}
+		break;
+	case HASH_TABLE_V2_LOCK_PADDED:
+	case HASH_TABLE_V2_LOCK_STRIPED:
+		hash_table->lock_count = HASH_TABLE_CAPACITY;
+		if (hash_table->options.lock == HASH_TABLE_V2_LOCK_STRIPED) {
+			hash_table->lock_count = hash_table->options.lock_stripes != 0
+			                         ? hash_table->options.lock_stripes
+			                         : DEFAULT_LOCK_STRIPES;
+		}
+		hash_table->padded_mutexes = aligned_alloc(CACHE_LINE_SIZE,
+		                                           hash_table->lock_count * sizeof(struct padded_mutex));
+		assert(hash_table->padded_mutexes != NULL);
+		for (size_t i = 0; i < hash_table->lock_count; ++i) {
+			pthread_mutex_init(&hash_table->padded_mutexes[i].mutex, NULL);
+		}
+		break;
+	case HASH_TABLE_V2_LOCK_TICKET:
+		hash_table->lock_count = HASH_TABLE_CAPACITY;
+		hash_table->ticket_locks = calloc(HASH_TABLE_CAPACITY, sizeof(struct ticket_lock));
+		assert(hash_table->ticket_locks != NULL);
+		break;
+	default:
+		assert(false);
+	}
+}
+
+static void destroy_locks(struct hash_table_v2 *hash_table)
+{
+	if (hash_table->mutexes != NULL) {
+		for (size_t i = 0; i < hash_table->lock_count; ++i) {
+			pthread_mutex_destroy(&hash_table->mutexes[i]);
+		}
+	}
+	if (hash_table->padded_mutexes != NULL) {
+		for (size_t i = 0; i < hash_table->lock_count; ++i) {
+			pthread_mutex_destroy(&hash_table->padded_mutexes[i].mutex);
+		}
+	}
+	free(hash_table->mutexes);
+	free(hash_table->padded_mutexes);
+	free(hash_table->ticket_locks);
+}
+
+/* Adds to one of the calling thread's counters, if the table keeps stats. */
+static void add_stat(struct hash_table_v2 *hash_table,
+                     uint64_t *counter,
+                     uint64_t n)
+{
+	if (hash_table->options.stats) {
+		__atomic_store_n(counter, *counter + n, __ATOMIC_RELAXED);
+	}
+}
+
+static void record_probes(struct hash_table_v2 *hash_table,
+                          struct hash_table_v2_thread *thread,
+                          uint64_t probes)
+{
+	if (!hash_table->options.stats) {
+		return;
+	}
+	struct thread_stats *stats = &thread->stats;
+	__atomic_store_n(&stats->lookups, stats->lookups + 1, __ATOMIC_RELAXED);
+	__atomic_store_n(&stats->probes, stats->probes + probes, __ATOMIC_RELAXED);
+	if (probes > stats->max_probe_depth) {
+		__atomic_store_n(&stats->max_probe_depth, probes, __ATOMIC_RELAXED);
+	}
+}
+
+static uint64_t get_nsec()
+{
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (uint64_t) time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+static void cpu_relax()
+{
+#if defined(__x86_64__) || defined(__i386__)
+	__builtin_ia32_pause();
+#endif
+}
+
+static void ticket_lock_acquire(struct ticket_lock *lock)
+{
+	uint16_t ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+	unsigned spins = 0;
+	while (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket) {
+		if (++spins == TICKET_LOCK_SPINS) {
+			spins = 0;
+			sched_yield();
+		}
+		else {
+			cpu_relax();
+		}
+	}
+}
+
+/* Takes the lock only if nobody holds it or waits for it. */
+static bool ticket_lock_try_acquire(struct ticket_lock *lock)
+{
+	uint16_t owner = __atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE);
+	uint16_t next = owner;
+	return __atomic_compare_exchange_n(&lock->next, &next, (uint16_t) (owner + 1),
+	                                   false, __ATOMIC_ACQUIRE, __ATOMIC_RELAXED);
+}
+
+static void ticket_lock_release(struct ticket_lock *lock)
+{
+	/* Only the holder writes `owner`. */
+	uint16_t owner = __atomic_load_n(&lock->owner, __ATOMIC_RELAXED);
+	__atomic_store_n(&lock->owner, (uint16_t) (owner + 1), __ATOMIC_RELEASE);
+}
+
+/* Buckets with the same lock index share a lock. */
+static uint32_t get_lock_index(struct hash_table_v2 *hash_table,
+                               size_t index)
+{
+	if (hash_table->padded_mutexes != NULL) {
+		return index % hash_table->lock_count;
+	}
+	return index;
+}
+
+static pthread_mutex_t *get_bucket_mutex(struct hash_table_v2 *hash_table,
+                                         size_t index)
+{
+	if (hash_table->mutexes != NULL) {
+		return &hash_table->mutexes[index];
+	}
+	return &hash_table->padded_mutexes[index % hash_table->lock_count].mutex;
+}
+
+static bool try_lock_bucket(struct hash_table_v2 *hash_table,
+                            size_t index)
+{
+	if (hash_table->ticket_locks != NULL) {
+		return ticket_lock_try_acquire(&hash_table->ticket_locks[index]);
+	}
+	return pthread_mutex_trylock(get_bucket_mutex(hash_table, index)) == 0;
+}
+
+/* With stats, we try the lock first to find out whether it's contended, and
+   only read the clock if we have to wait for it. */
+static void lock_bucket(struct hash_table_v2 *hash_table,
+                        struct hash_table_v2_thread *thread,
+                        struct hash_table_entry *hash_table_entry)
+{
+	size_t index = hash_table_entry - hash_table->entries;
+	uint64_t start = 0;
+	if (hash_table->options.stats) {
+		add_stat(hash_table, &thread->stats.lock_acquisitions, 1);
+		if (try_lock_bucket(hash_table, index)) {
+			return;
+		}
+		add_stat(hash_table, &thread->stats.lock_contended, 1);
+		start = get_nsec();
+	}
+	if (hash_table->ticket_locks != NULL) {
+		ticket_lock_acquire(&hash_table->ticket_locks[index]);
+	}
+	else {
+		pthread_mutex_lock(get_bucket_mutex(hash_table, index));
+	}
+	if (hash_table->options.stats) {
+		add_stat(hash_table, &thread->stats.lock_wait_nsec, get_nsec() - start);
+	}
+}
+
+static void unlock_bucket(struct hash_table_v2 *hash_table,
+                          struct hash_table_entry *hash_table_entry)
+{
+	size_t index = hash_table_entry - hash_table->entries;
+	if (hash_table->ticket_locks != NULL) {
+		ticket_lock_release(&hash_table->ticket_locks[index]);
+		return;
+	}
+	pthread_mutex_unlock(get_bucket_mutex(hash_table, index));
+}
+
+struct hash_table_v2 *hash_table_v2_create_with_options(const struct hash_table_v2_options *options)
 {
 	struct hash_table_v2 *hash_table = calloc(1, sizeof(struct hash_table_v2));
 	assert(hash_table != NULL);
+	if (options != NULL) {
+		hash_table->options = *options;
+	}
+	if (hash_table->options.key_width != 0) {
+		hash_table->hash = get_fixed_width_hash_function(hash_table->options.key_width);
+		assert(hash_table->hash != NULL);
+	}
+	else {
+		hash_table->hash = get_hash_function(hash_table->options.hash);
+	}
+	hash_table->id = __atomic_fetch_add(&next_table_id, 1, __ATOMIC_RELAXED);
+	hash_table->epoch = 1;
+	pthread_mutex_init(&hash_table->threads_mutex, NULL);
 	for (size_t i = 0; i < HASH_TABLE_CAPACITY; ++i) {
 		struct hash_table_entry *entry = &hash_table->entries[i];
 		SLIST_INIT(&entry->list_head);
-		// initialize mutex
-		pthread_mutex_init(&entry->mutex, NULL);
+	}
+	create_locks(hash_table);
+	if (hash_table->options.filter_capacity != 0) {
+		bloom_filter_init(&hash_table->filter, hash_table->options.filter_capacity,
+		                  hash_table->options.filter_bits_per_key);
 	}
 	return hash_table;
 }
 
-static struct hash_table_entry *get_hash_table_entry(struct hash_table_v2 *hash_table,
-                                                     const char *key)
+struct hash_table_v2 *hash_table_v2_create()
+{
+	return hash_table_v2_create_with_options(NULL);
+}
+
+static uint32_t get_hash(struct hash_table_v2 *hash_table,
+                         const char *key)
 {
 	assert(key != NULL);
-	uint32_t index = bernstein_hash(key) % HASH_TABLE_CAPACITY;
+	return hash_table->hash(key);
+}
+
+static struct hash_table_entry *get_hash_table_entry(struct hash_table_v2 *hash_table,
+                                                     uint32_t hash)
+{
+	uint32_t index = hash % HASH_TABLE_CAPACITY;
 	struct hash_table_entry *entry = &hash_table->entries[index];
 	return entry;
 }
 
-static struct list_entry *get_list_entry(struct list_head *list_head,
+/* Returns false if the filter is sure `key` isn't in the table. */
+static bool filter_may_contain(struct hash_table_v2 *hash_table,
+                               struct hash_table_v2_thread *thread,
+                               uint32_t hash)
+{
+	if (hash_table->options.filter_capacity == 0) {
+		return true;
+	}
+	if (bloom_filter_may_contain(&hash_table->filter, hash)) {
+		return true;
+	}
+	add_stat(hash_table, &thread->stats.filter_negatives, 1);
+	return false;
+}
+
+/* Counts a walk the filter let through that didn't find its key. */
+static void record_filter_miss(struct hash_table_v2 *hash_table,
+                               struct hash_table_v2_thread *thread,
+                               struct list_entry *list_entry)
+{
+	if (hash_table->options.filter_capacity != 0 && list_entry == NULL) {
+		add_stat(hash_table, &thread->stats.filter_false_positives, 1);
+	}
+}
+
+/* Searches the nodes from `first` up to (but not including) `last` for `key`.
+   The links are loaded with acquire semantics so a node pushed by another
+   thread is fully initialized by the time we read its key. If `last` was
+   removed in the meantime we just search to the end of the list. */
+static struct list_entry *get_list_entry_between(struct hash_table_v2 *hash_table,
+                                                 struct hash_table_v2_thread *thread,
+                                                 struct list_entry *first,
+                                                 struct list_entry *last,
+                                                 const char *key)
+{
+	struct list_entry *entry = first;
+	uint64_t probes = 0;
+	while (entry != last && entry != NULL) {
+		++probes;
+		if (keys_equal(hash_table, get_key(entry), key)) {
+			break;
+		}
+		entry = __atomic_load_n(&SLIST_NEXT(entry, pointers), __ATOMIC_ACQUIRE);
+	}
+	record_probes(hash_table, thread, probes);
+	return entry != last ? entry : NULL;
+}
+
+/* Readers never take the bucket lock. Writers only ever publish a fully
+   initialized node with a release store, and an unlinked node keeps its link
+   to the rest of the list until epoch-based reclamation says no reader can
+   be on it, so following the links with acquire loads always sees a
+   consistent list. This makes lookups wait-free: they never block or retry,
+   no matter what the writers are doing. Callers must be between
+   `enter_epoch` and `exit_epoch`. */
+static struct list_entry *get_list_entry(struct hash_table_v2 *hash_table,
+                                         struct hash_table_v2_thread *thread,
+                                         struct list_head *list_head,
                                          const char *key)
 {
 	assert(key != NULL);
+	struct list_entry *first = __atomic_load_n(&SLIST_FIRST(list_head), __ATOMIC_ACQUIRE);
+	return get_list_entry_between(hash_table, thread, first, NULL, key);
+}
+
+static const char *get_buffered_key(struct insert_buffer *buffer,
+                                    const struct buffered_insert *insert)
+{
+	return insert->key != NULL ? insert->key : buffer->keys + insert->key_offset;
+}
+
+/* The low bits of `hash` pick the key's bucket, and a buffer often holds
+   many keys of one bucket, so the index slot is picked from all of them. */
+static uint32_t get_index_slot(struct insert_buffer *buffer, uint32_t hash)
+{
+	uint32_t x = hash * 0x9E3779B1u;
+	return (x ^ (x >> 16)) & buffer->index_mask;
+}
 
-	struct list_entry *entry = NULL;
-	
-	SLIST_FOREACH(entry, list_head, pointers) {
-	  if (strcmp(entry->key, key) == 0) {
-	    return entry;
-	  }
+/* Returns the index slot of `key`'s newest buffered insert, or the empty
+   slot where it would go. */
+static uint32_t *find_index_slot(struct hash_table_v2 *hash_table,
+                                 struct insert_buffer *buffer,
+                                 uint32_t hash,
+                                 const char *key)
+{
+	uint32_t slot = get_index_slot(buffer, hash);
+	while (buffer->index[slot] != 0) {
+		struct buffered_insert *insert = &buffer->inserts[buffer->index[slot] - 1];
+		if (insert->hash == hash && keys_equal(hash_table, get_buffered_key(buffer, insert), key)) {
+			break;
+		}
+		slot = (slot + 1) & buffer->index_mask;
 	}
-	return NULL;
+	return &buffer->index[slot];
+}
+
+/* Returns the thread's newest buffered insert of `key`, or `NULL`. */
+static struct buffered_insert *find_buffered_insert(struct hash_table_v2 *hash_table,
+                                                    struct hash_table_v2_thread *thread,
+                                                    uint32_t hash,
+                                                    const char *key)
+{
+	struct insert_buffer *buffer = &thread->buffer;
+	uint32_t position = *find_index_slot(hash_table, buffer, hash, key);
+	return position != 0 ? &buffer->inserts[position - 1] : NULL;
 }
 
 bool hash_table_v2_contains(struct hash_table_v2 *hash_table,
                             const char *key)
 {
-	struct hash_table_entry *hash_table_entry = get_hash_table_entry(hash_table, key);
+	uint32_t hash = get_hash(hash_table, key);
+	struct hash_table_v2_thread *thread = get_thread(hash_table);
+	if (thread->buffer.count != 0 && find_buffered_insert(hash_table, thread, hash, key) != NULL) {
+		return true;
+	}
+	if (!filter_may_contain(hash_table, thread, hash)) {
+		return false;
+	}
+	struct hash_table_entry *hash_table_entry = get_hash_table_entry(hash_table, hash);
 	struct list_head *list_head = &hash_table_entry->list_head;
-	struct list_entry *list_entry = get_list_entry(list_head, key);
+	enter_epoch(hash_table, thread);
+	struct list_entry *list_entry = get_list_entry(hash_table, thread, list_head, key);
+	exit_epoch(thread);
+	record_filter_miss(hash_table, thread, list_entry);
 	return list_entry != NULL;
 }
 
+/* Lock-free insert. The new node is pushed onto the head of the bucket with a
+   CAS. Nodes are only ever added at the head, so if the CAS fails the only
+   nodes we haven't checked for a duplicate key are the ones between the new
+   head and the head we scanned from. We re-check just those before trying
+   again, which keeps each key in the bucket exactly once. Being inside an
+   epoch also means no node we scanned can be reused behind our back, so a
+   CAS can't succeed because of ABA. */
+static void add_entry_lock_free(struct hash_table_v2 *hash_table,
+                                struct hash_table_v2_thread *thread,
+                                struct list_head *list_head,
+                                uint32_t hash,
+                                const char *key,
+                                uint32_t value)
+{
+	struct list_entry *head = __atomic_load_n(&SLIST_FIRST(list_head), __ATOMIC_ACQUIRE);
+	struct list_entry *list_entry = get_list_entry_between(hash_table, thread, head, NULL, key);
+
+	/* Update the value if it already exists */
+	if (list_entry != NULL) {
+		__atomic_store_n(&list_entry->value, value, __ATOMIC_RELAXED);
+		return;
+	}
+
+	struct list_entry *new_entry = create_list_entry(hash_table, thread, hash, key, value);
+
+	while (true) {
+		struct list_entry *scanned = head;
+		SLIST_NEXT(new_entry, pointers) = head;
+		if (__atomic_compare_exchange_n(&SLIST_FIRST(list_head), &head, new_entry,
+		                                false, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+			return;
+		}
+		add_stat(hash_table, &thread->stats.cas_failures, 1);
+		list_entry = get_list_entry_between(hash_table, thread, head, scanned, key);
+		if (list_entry != NULL) {
+			__atomic_store_n(&list_entry->value, value, __ATOMIC_RELAXED);
+			thread->spare = new_entry;
+			return;
+		}
+	}
+}
+
+/* Inserts with the bucket lock held. */
+static void add_entry_locked(struct hash_table_v2 *hash_table,
+                             struct hash_table_v2_thread *thread,
+                             struct list_head *list_head,
+                             uint32_t hash,
+                             const char *key,
+                             uint32_t value)
+{
+	struct list_entry *list_entry = get_list_entry(hash_table, thread, list_head, key);
+
+	/* Update the value if it already exists */
+	if (list_entry != NULL) {
+		__atomic_store_n(&list_entry->value, value, __ATOMIC_RELAXED);
+		return;
+	}
+
+	list_entry = create_list_entry(hash_table, thread, hash, key, value);
+
+	/* Same as `SLIST_INSERT_HEAD`, but publishes the node with a release
+	   store for the readers. */
+	SLIST_NEXT(list_entry, pointers) = SLIST_FIRST(list_head);
+	__atomic_store_n(&SLIST_FIRST(list_head), list_entry, __ATOMIC_RELEASE);
+}
+
+static int compare_buffered_inserts(const void *a, const void *b)
+{
+	const struct buffered_insert *x = a;
+	const struct buffered_insert *y = b;
+	if (x->lock != y->lock) {
+		return x->lock < y->lock ? -1 : 1;
+	}
+	uint32_t x_index = x->hash % HASH_TABLE_CAPACITY;
+	uint32_t y_index = y->hash % HASH_TABLE_CAPACITY;
+	if (x_index != y_index) {
+		return x_index < y_index ? -1 : 1;
+	}
+	return (x->sequence > y->sequence) - (x->sequence < y->sequence);
+}
+
+/* Inserts everything in the thread's buffer. The inserts are sorted by lock
+   and then bucket, so every lock is taken once (or, in lock-free mode, every
+   bucket is visited once inside one epoch) no matter how many keys it
+   covers. With striped locks that's once per stripe for all of its
+   buckets. */
+static void flush_buffer(struct hash_table_v2 *hash_table,
+                         struct hash_table_v2_thread *thread)
+{
+	struct insert_buffer *buffer = &thread->buffer;
+	if (buffer->count == 0) {
+		return;
+	}
+	add_stat(hash_table, &thread->stats.buffer_flushes, 1);
+	qsort(buffer->inserts, buffer->count, sizeof(struct buffered_insert),
+	      compare_buffered_inserts);
+	uint32_t i = 0;
+	while (i < buffer->count) {
+		uint32_t lock = buffer->inserts[i].lock;
+		struct hash_table_entry *hash_table_entry =
+			get_hash_table_entry(hash_table, buffer->inserts[i].hash);
+		uint32_t end = i + 1;
+		while (end < buffer->count && buffer->inserts[end].lock == lock) {
+			++end;
+		}
+		add_stat(hash_table, &thread->stats.buffer_flush_locks, 1);
+		if (hash_table->options.lock_free) {
+			enter_epoch(hash_table, thread);
+		}
+		else {
+			lock_bucket(hash_table, thread, hash_table_entry);
+		}
+		for (; i < end; ++i) {
+			struct buffered_insert *insert = &buffer->inserts[i];
+			const char *key = get_buffered_key(buffer, insert);
+			struct list_head *list_head =
+				&get_hash_table_entry(hash_table, insert->hash)->list_head;
+			if (hash_table->options.lock_free) {
+				add_entry_lock_free(hash_table, thread, list_head, insert->hash, key, insert->value);
+			}
+			else {
+				add_entry_locked(hash_table, thread, list_head, insert->hash, key, insert->value);
+			}
+		}
+		if (hash_table->options.lock_free) {
+			exit_epoch(thread);
+		}
+		else {
+			unlock_bucket(hash_table, hash_table_entry);
+		}
+	}
+	buffer->count = 0;
+	buffer->keys_size = 0;
+	memset(buffer->index, 0, (buffer->index_mask + 1) * sizeof(uint32_t));
+}
+
+/* Adds an insert to the thread's buffer, flushing it once it's full. If the
+   table owns its keys, the key is copied to the buffer's key pool, since the
+   caller's copy may be gone by the time we flush. */
+static void buffer_insert(struct hash_table_v2 *hash_table,
+                          struct hash_table_v2_thread *thread,
+                          uint32_t hash,
+                          const char *key,
+                          uint32_t value)
+{
+	struct insert_buffer *buffer = &thread->buffer;
+	struct buffered_insert *insert = &buffer->inserts[buffer->count];
+	insert->key = key;
+	insert->hash = hash;
+	insert->value = value;
+	insert->sequence = buffer->count;
+	insert->lock = get_lock_index(hash_table, hash % HASH_TABLE_CAPACITY);
+	if (hash_table->options.own_keys) {
+		size_t length = get_key_size(hash_table, key);
+		if (buffer->keys_size + length > buffer->keys_capacity) {
+			while (buffer->keys_size + length > buffer->keys_capacity) {
+				buffer->keys_capacity = buffer->keys_capacity == 0 ? 4096 : buffer->keys_capacity * 2;
+			}
+			buffer->keys = realloc(buffer->keys, buffer->keys_capacity);
+			assert(buffer->keys != NULL);
+		}
+		memcpy(buffer->keys + buffer->keys_size, key, length);
+		insert->key = NULL;
+		insert->key_offset = buffer->keys_size;
+		buffer->keys_size += length;
+	}
+	/* A newer insert of a key replaces the older one in the index, both
+	   stay in `inserts` and the flush applies them in order. */
+	*find_index_slot(hash_table, buffer, hash, key) = buffer->count + 1;
+	if (++buffer->count == hash_table->options.insert_buffer) {
+		flush_buffer(hash_table, thread);
+	}
+}
+
+void hash_table_v2_flush(struct hash_table_v2 *hash_table)
+{
+	if (hash_table->options.insert_buffer == 0) {
+		return;
+	}
+	flush_buffer(hash_table, get_thread(hash_table));
+}
+
+static void add_entry(struct hash_table_v2 *hash_table,
+                      struct hash_table_v2_thread *thread,
+                      struct hash_table_entry *hash_table_entry,
+                      uint32_t hash,
+                      const char *key,
+                      uint32_t value)
+{
+	struct list_head *list_head = &hash_table_entry->list_head;
+
+	if (hash_table->options.insert_buffer != 0) {
+		buffer_insert(hash_table, thread, hash, key, value);
+		return;
+	}
+
+	if (hash_table->options.lock_free) {
+		enter_epoch(hash_table, thread);
+		add_entry_lock_free(hash_table, thread, list_head, hash, key, value);
+		exit_epoch(thread);
+		return;
+	}
+
+	/* The duplicate check has to happen under the lock, otherwise two
+	   threads inserting the same key could both miss it and add it twice. */
+	lock_bucket(hash_table, thread, hash_table_entry);
+	add_entry_locked(hash_table, thread, list_head, hash, key, value);
+	unlock_bucket(hash_table, hash_table_entry);
+}
+
 void hash_table_v2_add_entry(struct hash_table_v2 *hash_table,
                              const char *key,
                              uint32_t value)
 {
-	struct hash_table_entry *hash_table_entry = get_hash_table_entry(hash_table, key);
+	uint32_t hash = get_hash(hash_table, key);
+	struct hash_table_entry *hash_table_entry = get_hash_table_entry(hash_table, hash);
+	struct hash_table_v2_thread *thread = get_thread(hash_table);
+	add_entry(hash_table, thread, hash_table_entry, hash, key, value);
+}
+
+/* How `upsert` changes a key's value. */
+struct value_update {
+	/* Returns the new value, `NULL` to add `delta` instead. */
+	uint32_t (*function)(bool exists, uint32_t value, void *context);
+	void *context;
+	uint32_t delta;
+};
+
+/* Updates an entry that is already in the table and returns its new value.
+   The update is atomic, so concurrent upserts of the same key never lose
+   one another's update. */
+static uint32_t apply_update(struct hash_table_v2 *hash_table,
+                             struct hash_table_v2_thread *thread,
+                             struct list_entry *list_entry,
+                             const struct value_update *update)
+{
+	if (update->function == NULL) {
+		return __atomic_add_fetch(&list_entry->value, update->delta, __ATOMIC_RELAXED);
+	}
+	uint32_t value = __atomic_load_n(&list_entry->value, __ATOMIC_RELAXED);
+	while (true) {
+		uint32_t new_value = update->function(true, value, update->context);
+		if (__atomic_compare_exchange_n(&list_entry->value, &value, new_value,
+		                                true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+			return new_value;
+		}
+		add_stat(hash_table, &thread->stats.cas_failures, 1);
+	}
+}
 
+/* Returns the value of a key that isn't in the table yet. */
+static uint32_t get_initial_value(const struct value_update *update)
+{
+	if (update->function == NULL) {
+		return update->delta;
+	}
+	return update->function(false, 0, update->context);
+}
 
+/* A single pass over the bucket: an existing entry is updated in place
+   without the lock, only a new key takes the lock (or a CAS in lock-free
+   mode) to be inserted. If another thread inserts the key first, we update
+   its entry instead. */
+static uint32_t upsert(struct hash_table_v2 *hash_table,
+                       const char *key,
+                       const struct value_update *update)
+{
+	uint32_t hash = get_hash(hash_table, key);
+	struct hash_table_entry *hash_table_entry = get_hash_table_entry(hash_table, hash);
 	struct list_head *list_head = &hash_table_entry->list_head;
-	struct list_entry *list_entry = get_list_entry(list_head, key);
+	struct hash_table_v2_thread *thread = get_thread(hash_table);
+	uint32_t value;
 
-	/* Update the value if it already exists */
+	/* Our own buffered insert of the key has to be in the table for the
+	   update to start from its value. */
+	flush_buffer(hash_table, thread);
+
+	enter_epoch(hash_table, thread);
+	struct list_entry *head = __atomic_load_n(&SLIST_FIRST(list_head), __ATOMIC_ACQUIRE);
+	struct list_entry *list_entry = get_list_entry_between(hash_table, thread, head, NULL, key);
 	if (list_entry != NULL) {
-		list_entry->value = value;
-		return;
+		value = apply_update(hash_table, thread, list_entry, update);
+		exit_epoch(thread);
+		return value;
 	}
 
-	list_entry = calloc(1, sizeof(struct list_entry));
-	list_entry->key = key;
-	list_entry->value = value;
+	value = get_initial_value(update);
+	if (hash_table->options.lock_free) {
+		struct list_entry *new_entry = create_list_entry(hash_table, thread, hash, key, value);
+		while (true) {
+			struct list_entry *scanned = head;
+			SLIST_NEXT(new_entry, pointers) = head;
+			if (__atomic_compare_exchange_n(&SLIST_FIRST(list_head), &head, new_entry,
+			                                false, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE)) {
+				break;
+			}
+			add_stat(hash_table, &thread->stats.cas_failures, 1);
+			list_entry = get_list_entry_between(hash_table, thread, head, scanned, key);
+			if (list_entry != NULL) {
+				thread->spare = new_entry;
+				value = apply_update(hash_table, thread, list_entry, update);
+				break;
+			}
+		}
+		exit_epoch(thread);
+		return value;
+	}
 
-	pthread_mutex_lock(&hash_table_entry->mutex);
+	lock_bucket(hash_table, thread, hash_table_entry);
+	/* A remove may have changed the bucket since, so search all of it. */
+	list_entry = get_list_entry(hash_table, thread, list_head, key);
+	if (list_entry == NULL) {
+		list_entry = create_list_entry(hash_table, thread, hash, key, value);
+		SLIST_NEXT(list_entry, pointers) = SLIST_FIRST(list_head);
+		__atomic_store_n(&SLIST_FIRST(list_head), list_entry, __ATOMIC_RELEASE);
+		unlock_bucket(hash_table, hash_table_entry);
+	}
+	else {
+		unlock_bucket(hash_table, hash_table_entry);
+		value = apply_update(hash_table, thread, list_entry, update);
+	}
+	exit_epoch(thread);
+	return value;
+}
 
-	SLIST_INSERT_HEAD(list_head, list_entry, pointers);
+uint32_t hash_table_v2_upsert(struct hash_table_v2 *hash_table,
+                              const char *key,
+                              uint32_t (*function)(bool exists, uint32_t value, void *context),
+                              void *context)
+{
+	assert(function != NULL);
+	struct value_update update = { .function = function, .context = context };
+	return upsert(hash_table, key, &update);
+}
 
-	pthread_mutex_unlock(&hash_table_entry->mutex);
+uint32_t hash_table_v2_fetch_add(struct hash_table_v2 *hash_table,
+                                 const char *key,
+                                 uint32_t delta)
+{
+	struct value_update update = { .delta = delta };
+	return upsert(hash_table, key, &update) - delta;
+}
+
+/* The batch calls work through their keys in windows of this many. A window
+   is small enough that everything we prefetch for it is still in the cache
+   when we get to use it, and large enough to have many misses in flight. */
+#define BATCH_WINDOW 16
+
+/* Finds the buckets for a window of keys and prefetches them. We hash the
+   whole window and prefetch every bucket (and filter block) first, then
+   prefetch the first node of every chain, so the cache misses for different
+   keys overlap instead of being taken one after the other. */
+static void prefetch_window(struct hash_table_v2 *hash_table,
+                            const char *const *keys,
+                            size_t count,
+                            uint32_t *hashes,
+                            struct hash_table_entry **entries,
+                            bool write)
+{
+	for (size_t i = 0; i < count; ++i) {
+		hashes[i] = get_hash(hash_table, keys[i]);
+		entries[i] = get_hash_table_entry(hash_table, hashes[i]);
+		if (hash_table->options.filter_capacity != 0) {
+			bloom_filter_prefetch(&hash_table->filter, hashes[i]);
+		}
+		if (write) {
+			__builtin_prefetch(entries[i], 1, 3);
+		}
+		else {
+			__builtin_prefetch(entries[i], 0, 3);
+		}
+	}
+	for (size_t i = 0; i < count; ++i) {
+		struct list_entry *first = __atomic_load_n(&SLIST_FIRST(&entries[i]->list_head),
+		                                           __ATOMIC_ACQUIRE);
+		if (first != NULL) {
+			__builtin_prefetch(first, 0, 3);
+		}
+	}
+}
+
+void hash_table_v2_add_entries(struct hash_table_v2 *hash_table,
+                               const char *const *keys,
+                               const uint32_t *values,
+                               size_t count)
+{
+	struct hash_table_v2_thread *thread = get_thread(hash_table);
+	uint32_t hashes[BATCH_WINDOW];
+	struct hash_table_entry *entries[BATCH_WINDOW];
+	for (size_t start = 0; start < count; start += BATCH_WINDOW) {
+		size_t window = count - start < BATCH_WINDOW ? count - start : BATCH_WINDOW;
+		prefetch_window(hash_table, &keys[start], window, hashes, entries, true);
+		for (size_t i = 0; i < window; ++i) {
+			add_entry(hash_table, thread, entries[i], hashes[i],
+			          keys[start + i], values[start + i]);
+		}
+	}
+}
+
+void hash_table_v2_contains_many(struct hash_table_v2 *hash_table,
+                                 const char *const *keys,
+                                 bool *results,
+                                 size_t count)
+{
+	struct hash_table_v2_thread *thread = get_thread(hash_table);
+	uint32_t hashes[BATCH_WINDOW];
+	struct hash_table_entry *entries[BATCH_WINDOW];
+	for (size_t start = 0; start < count; start += BATCH_WINDOW) {
+		size_t window = count - start < BATCH_WINDOW ? count - start : BATCH_WINDOW;
+		enter_epoch(hash_table, thread);
+		prefetch_window(hash_table, &keys[start], window, hashes, entries, false);
+		for (size_t i = 0; i < window; ++i) {
+			if (thread->buffer.count != 0
+			    && find_buffered_insert(hash_table, thread, hashes[i], keys[start + i]) != NULL) {
+				results[start + i] = true;
+				continue;
+			}
+			if (!filter_may_contain(hash_table, thread, hashes[i])) {
+				results[start + i] = false;
+				continue;
+			}
+			struct list_entry *list_entry = get_list_entry(hash_table, thread,
+			                                               &entries[i]->list_head,
+			                                               keys[start + i]);
+			record_filter_miss(hash_table, thread, list_entry);
+			results[start + i] = list_entry != NULL;
+		}
+		exit_epoch(thread);
+	}
+}
+
+void hash_table_v2_get_values(struct hash_table_v2 *hash_table,
+                              const char *const *keys,
+                              uint32_t *values,
+                              size_t count)
+{
+	struct hash_table_v2_thread *thread = get_thread(hash_table);
+	uint32_t hashes[BATCH_WINDOW];
+	struct hash_table_entry *entries[BATCH_WINDOW];
+	for (size_t start = 0; start < count; start += BATCH_WINDOW) {
+		size_t window = count - start < BATCH_WINDOW ? count - start : BATCH_WINDOW;
+		enter_epoch(hash_table, thread);
+		prefetch_window(hash_table, &keys[start], window, hashes, entries, false);
+		for (size_t i = 0; i < window; ++i) {
+			if (thread->buffer.count != 0) {
+				struct buffered_insert *insert = find_buffered_insert(hash_table, thread,
+				                                                      hashes[i],
+				                                                      keys[start + i]);
+				if (insert != NULL) {
+					values[start + i] = insert->value;
+					continue;
+				}
+			}
+			struct list_entry *list_entry = get_list_entry(hash_table, thread,
+			                                               &entries[i]->list_head,
+			                                               keys[start + i]);
+			assert(list_entry != NULL);
+			values[start + i] = __atomic_load_n(&list_entry->value, __ATOMIC_RELAXED);
+		}
+		exit_epoch(thread);
+	}
 }
 
 uint32_t hash_table_v2_get_value(struct hash_table_v2 *hash_table,
                                  const char *key)
 {
-	struct hash_table_entry *hash_table_entry = get_hash_table_entry(hash_table, key);
+	uint32_t hash = get_hash(hash_table, key);
+	struct hash_table_entry *hash_table_entry = get_hash_table_entry(hash_table, hash);
 	struct list_head *list_head = &hash_table_entry->list_head;
-	struct list_entry *list_entry = get_list_entry(list_head, key);
+	struct hash_table_v2_thread *thread = get_thread(hash_table);
+	if (thread->buffer.count != 0) {
+		struct buffered_insert *insert = find_buffered_insert(hash_table, thread, hash, key);
+		if (insert != NULL) {
+			return insert->value;
+		}
+	}
+	enter_epoch(hash_table, thread);
+	struct list_entry *list_entry = get_list_entry(hash_table, thread, list_head, key);
 	assert(list_entry != NULL);
-	return list_entry->value;
+	uint32_t value = __atomic_load_n(&list_entry->value, __ATOMIC_RELAXED);
+	exit_epoch(thread);
+	return value;
 }
 
-void hash_table_v2_destroy(struct hash_table_v2 *hash_table)
+/* Removers take the bucket lock, so at most one thread unlinks from a bucket
+   at a time, and the links after the head only change under that lock. The
+   head itself can also change under us in lock-free mode, where inserts push
+   without the lock, so there we unlink a head node with a CAS and look for
+   its new predecessor if an insert got in first. The unlinked node keeps its
+   link for readers that are still on it and is retired instead of freed. */
+bool hash_table_v2_remove(struct hash_table_v2 *hash_table,
+                          const char *key)
 {
+	uint32_t hash = get_hash(hash_table, key);
+	struct hash_table_v2_thread *thread = get_thread(hash_table);
+	/* Otherwise a buffered insert of the key would bring it back. */
+	flush_buffer(hash_table, thread);
+	/* A key the filter has never seen can't be removed, so don't lock. */
+	if (!filter_may_contain(hash_table, thread, hash)) {
+		return false;
+	}
+	struct hash_table_entry *hash_table_entry = get_hash_table_entry(hash_table, hash);
+	struct list_head *list_head = &hash_table_entry->list_head;
+
+	lock_bucket(hash_table, thread, hash_table_entry);
+
+	struct list_entry *list_entry = get_list_entry(hash_table, thread, list_head, key);
+	if (list_entry == NULL) {
+		unlock_bucket(hash_table, hash_table_entry);
+		return false;
+	}
+	struct list_entry *next = SLIST_NEXT(list_entry, pointers);
+
+	struct list_entry *head = __atomic_load_n(&SLIST_FIRST(list_head), __ATOMIC_ACQUIRE);
+	bool unlinked = false;
+	if (head == list_entry) {
+		if (hash_table->options.lock_free) {
+			unlinked = __atomic_compare_exchange_n(&SLIST_FIRST(list_head), &head, next,
+			                                       false, __ATOMIC_RELEASE, __ATOMIC_ACQUIRE);
+			if (!unlinked) {
+				add_stat(hash_table, &thread->stats.cas_failures, 1);
+			}
+		}
+		else {
+			__atomic_store_n(&SLIST_FIRST(list_head), next, __ATOMIC_RELEASE);
+			unlinked = true;
+		}
+	}
+	if (!unlinked) {
+		struct list_entry *previous = head;
+		while (SLIST_NEXT(previous, pointers) != list_entry) {
+			previous = SLIST_NEXT(previous, pointers);
+		}
+		__atomic_store_n(&SLIST_NEXT(previous, pointers), next, __ATOMIC_RELEASE);
+	}
+
+	unlock_bucket(hash_table, hash_table_entry);
+
+	retire_list_entry(hash_table, thread, list_entry);
+	return true;
+}
+
+/* Calls `function` for every entry in the buckets [begin, end). We hold an
+   epoch for one bucket at a time, so a long walk doesn't keep removes
+   elsewhere from reclaiming. */
+static void foreach_between(struct hash_table_v2 *hash_table,
+                            struct hash_table_v2_thread *thread,
+                            size_t begin,
+                            size_t end,
+                            void (*function)(const char *key, uint32_t value, void *context),
+                            void *context)
+{
+	for (size_t i = begin; i < end; ++i) {
+		enter_epoch(hash_table, thread);
+		struct list_entry *list_entry = __atomic_load_n(&SLIST_FIRST(&hash_table->entries[i].list_head),
+		                                                __ATOMIC_ACQUIRE);
+		while (list_entry != NULL) {
+			function(get_key(list_entry), __atomic_load_n(&list_entry->value, __ATOMIC_RELAXED),
+			         context);
+			list_entry = __atomic_load_n(&SLIST_NEXT(list_entry, pointers), __ATOMIC_ACQUIRE);
+		}
+		exit_epoch(thread);
+	}
+}
+
+void hash_table_v2_foreach(struct hash_table_v2 *hash_table,
+                           void (*function)(const char *key, uint32_t value, void *context),
+                           void *context)
+{
+	foreach_between(hash_table, get_thread(hash_table), 0, HASH_TABLE_CAPACITY,
+	                function, context);
+}
+
+struct partition_worker {
+	struct hash_table_v2 *hash_table;
+	uint32_t partition;
+	uint32_t partition_count;
+	void (*function)(const char *key, uint32_t value, void *context);
+	void *context;
+	pthread_t thread;
+};
+
+static void *run_partition_worker(void *arg)
+{
+	struct partition_worker *worker = arg;
+	size_t begin = (size_t) HASH_TABLE_CAPACITY * worker->partition / worker->partition_count;
+	size_t end = (size_t) HASH_TABLE_CAPACITY * (worker->partition + 1) / worker->partition_count;
+	struct hash_table_v2_thread *thread = acquire_walker(worker->hash_table);
+	foreach_between(worker->hash_table, thread, begin, end, worker->function, worker->context);
+	release_walker(worker->hash_table, thread);
+	return NULL;
+}
+
+void hash_table_v2_foreach_partition(struct hash_table_v2 *hash_table,
+                                     uint32_t partition_count,
+                                     void (*function)(const char *key, uint32_t value, void *context),
+                                     void **contexts)
+{
+	assert(partition_count > 0);
+	struct partition_worker *workers = calloc(partition_count, sizeof(struct partition_worker));
+	assert(workers != NULL);
+	for (uint32_t i = 0; i < partition_count; ++i) {
+		struct partition_worker *worker = &workers[i];
+		worker->hash_table = hash_table;
+		worker->partition = i;
+		worker->partition_count = partition_count;
+		worker->function = function;
+		worker->context = contexts != NULL ? contexts[i] : NULL;
+		int err = pthread_create(&worker->thread, NULL, run_partition_worker, worker);
+		assert(err == 0);
+		(void) err;
+	}
+	for (uint32_t i = 0; i < partition_count; ++i) {
+		pthread_join(workers[i].thread, NULL);
+	}
+	free(workers);
+}
+
+static void add_to_snapshot(const char *key, uint32_t value, void *context)
+{
+	hash_table_snapshot_builder_add(context, key, value);
+}
+
+bool hash_table_v2_save(struct hash_table_v2 *hash_table,
+                        const char *path)
+{
+	struct hash_table_snapshot_builder *builder =
+		hash_table_snapshot_builder_create(hash_table->options.hash);
+	hash_table_v2_foreach(hash_table, add_to_snapshot, builder);
+	bool ok = hash_table_snapshot_builder_write(builder, path);
+	hash_table_snapshot_builder_destroy(builder);
+	return ok;
+}
+
+void hash_table_v2_stats(struct hash_table_v2 *hash_table,
+                         struct hash_table_v2_stats *stats)
+{
+	memset(stats, 0, sizeof(struct hash_table_v2_stats));
+	if (hash_table->options.filter_capacity != 0) {
+		stats->filter_bytes = bloom_filter_bytes(&hash_table->filter);
+		stats->filter_bits_set = bloom_filter_bits_set(&hash_table->filter);
+	}
+
+	struct hash_table_v2_thread *thread = get_thread(hash_table);
 	for (size_t i = 0; i < HASH_TABLE_CAPACITY; ++i) {
-		struct hash_table_entry *entry = &hash_table->entries[i];
-		struct list_head *list_head = &entry->list_head;
-		struct list_entry *list_entry = NULL;
-		while (!SLIST_EMPTY(list_head)) {
-			list_entry = SLIST_FIRST(list_head);
-			SLIST_REMOVE_HEAD(list_head, pointers);
-			free(list_entry);
+		size_t length = 0;
+		enter_epoch(hash_table, thread);
+		struct list_entry *list_entry = __atomic_load_n(&SLIST_FIRST(&hash_table->entries[i].list_head),
+		                                                __ATOMIC_ACQUIRE);
+		while (list_entry != NULL) {
+			++length;
+			list_entry = __atomic_load_n(&SLIST_NEXT(list_entry, pointers), __ATOMIC_ACQUIRE);
+		}
+		exit_epoch(thread);
+		stats->entries += length;
+		if (length > stats->max_chain_length) {
+			stats->max_chain_length = length;
+		}
+		size_t bucket = length < HASH_TABLE_V2_STATS_CHAIN_LENGTHS
+		                ? length
+		                : HASH_TABLE_V2_STATS_CHAIN_LENGTHS - 1;
+		++stats->chain_lengths[bucket];
+	}
+
+	thread = __atomic_load_n(&hash_table->threads, __ATOMIC_ACQUIRE);
+	while (thread != NULL) {
+		struct thread_stats *thread_stats = &thread->stats;
+		stats->lookups += __atomic_load_n(&thread_stats->lookups, __ATOMIC_RELAXED);
+		stats->probes += __atomic_load_n(&thread_stats->probes, __ATOMIC_RELAXED);
+		uint64_t max_probe_depth = __atomic_load_n(&thread_stats->max_probe_depth, __ATOMIC_RELAXED);
+		if (max_probe_depth > stats->max_probe_depth) {
+			stats->max_probe_depth = max_probe_depth;
+		}
+		stats->lock_acquisitions += __atomic_load_n(&thread_stats->lock_acquisitions, __ATOMIC_RELAXED);
+		stats->lock_contended += __atomic_load_n(&thread_stats->lock_contended, __ATOMIC_RELAXED);
+		stats->lock_wait_nsec += __atomic_load_n(&thread_stats->lock_wait_nsec, __ATOMIC_RELAXED);
+		stats->cas_failures += __atomic_load_n(&thread_stats->cas_failures, __ATOMIC_RELAXED);
+		stats->filter_negatives += __atomic_load_n(&thread_stats->filter_negatives, __ATOMIC_RELAXED);
+		stats->filter_false_positives += __atomic_load_n(&thread_stats->filter_false_positives,
+		                                                 __ATOMIC_RELAXED);
+		stats->buffer_flushes += __atomic_load_n(&thread_stats->buffer_flushes, __ATOMIC_RELAXED);
+		stats->buffer_flush_locks += __atomic_load_n(&thread_stats->buffer_flush_locks, __ATOMIC_RELAXED);
+		thread = thread->next;
+	}
+}
+
+void hash_table_v2_destroy(struct hash_table_v2 *hash_table)
+{
+	destroy_locks(hash_table);
+	if (hash_table->options.filter_capacity != 0) {
+		bloom_filter_destroy(&hash_table->filter);
+	}
+	/* The list entries all live in the threads' arenas. */
+	struct hash_table_v2_thread *thread = hash_table->threads;
+	while (thread != NULL) {
+		struct hash_table_v2_thread *next = thread->next;
+		for (size_t i = 0; i < EPOCH_COUNT; ++i) {
+			free(thread->retired[i].entries);
 		}
-		// destroy mutex
-		pthread_mutex_destroy(&entry->mutex);
+		arena_destroy(&thread->arena);
+		free(thread->buffer.inserts);
+		free(thread->buffer.index);
+		free(thread->buffer.keys);
+		free(thread);
+		thread = next;
 	}
+	pthread_mutex_destroy(&hash_table->threads_mutex);
 	free(hash_table);
 }
@@ -3,14 +3,192 @@
 #include "hash-table-common.h"
 
 #include <stdbool.h>
+#include <stddef.h>
+
+/* How the bucket locks are laid out. The locks are kept apart from the
+   buckets themselves, so the lock-free lookups never touch them. */
+enum hash_table_v2_lock {
+	/* A `pthread_mutex_t` per bucket, packed next to each other. */
+	HASH_TABLE_V2_LOCK_MUTEX,
+	/* A `pthread_mutex_t` per bucket, each on its own cache line so threads
+	   locking neighbouring buckets don't false share. */
+	HASH_TABLE_V2_LOCK_PADDED,
+	/* `lock_stripes` padded mutexes, bucket `i` uses lock
+	   `i % lock_stripes`. */
+	HASH_TABLE_V2_LOCK_STRIPED,
+	/* A 4 byte ticket spinlock per bucket, fair and a lot smaller than a
+	   mutex, but waiters spin instead of sleeping. */
+	HASH_TABLE_V2_LOCK_TICKET,
+	HASH_TABLE_V2_LOCK_COUNT,
+};
+
+/* Optional behaviour selected when the table is created. A zeroed struct
+   gives the default per-bucket mutex table. */
+struct hash_table_v2_options {
+	/* Insert by pushing onto the bucket head with a CAS loop instead of
+	   taking the bucket's mutex. */
+	bool lock_free;
+	/* Hash function used to pick a key's bucket. */
+	enum hash_function hash;
+	/* Copy keys into the table instead of keeping the caller's pointer, so
+	   the caller's buffer doesn't have to outlive the table. Keys up to 15
+	   bytes are stored inside the entry. */
+	bool own_keys;
+	/* Layout of the bucket locks, used by inserts unless `lock_free` is set
+	   and always by removes. */
+	enum hash_table_v2_lock lock;
+	/* Number of locks for `HASH_TABLE_V2_LOCK_STRIPED`, 0 picks 64. */
+	uint32_t lock_stripes;
+	/* Count lookups, probes and lock contention for `hash_table_v2_stats`.
+	   Every thread counts on its own, but it still costs a little on every
+	   call. */
+	bool stats;
+	/* Expected number of keys for a Bloom filter in front of the buckets,
+	   0 for no filter. Lookups of a key the filter has never seen return
+	   without walking the bucket, which makes a mostly missing workload
+	   much cheaper. The filter can't forget keys, so removed keys still
+	   cost a walk, and inserting many more keys than this makes it less
+	   and less useful. */
+	size_t filter_capacity;
+	/* Filter size per expected key, 0 picks 10 bits, for about 1% false
+	   positives. */
+	uint32_t filter_bits_per_key;
+	/* Buffer up to this many inserts per thread, 0 to insert right away.
+	   A full buffer is sorted by lock and flushed in lock order, so a lock
+	   is taken once for all of its keys: a bucket's, or with striped locks
+	   a stripe's for all of its buckets. That only saves anything once the
+	   buffer holds several keys per lock. Buffered inserts are only
+	   visible to the thread that made them until it flushes, with
+	   `hash_table_v2_flush` or by filling its buffer. */
+	uint32_t insert_buffer;
+	/* 0 for ordinary strings, or 8, 16 or 32 if every key is a string of
+	   fewer than this many characters stored in a buffer of exactly this
+	   many bytes, zero padded after the terminator. Keys are then hashed
+	   and compared as whole words (SSE2 vectors for 16 and 32 bytes where
+	   available) instead of a byte at a time, and `hash` is ignored. */
+	uint32_t key_width;
+};
+
+/* `chain_lengths[i]` is the number of buckets with `i` entries, the last one
+   counts every longer chain too. */
+#define HASH_TABLE_V2_STATS_CHAIN_LENGTHS 16
+
+struct hash_table_v2_stats {
+	/* Found by walking the buckets when the stats are taken. */
+	uint64_t entries;
+	uint64_t max_chain_length;
+	uint64_t chain_lengths[HASH_TABLE_V2_STATS_CHAIN_LENGTHS];
+	/* The rest is summed over every thread, and only counted if the table
+	   was created with `stats`. */
+	/* Walks of a bucket's chain, and entries looked at during them. */
+	uint64_t lookups;
+	uint64_t probes;
+	/* The most entries a single walk looked at. */
+	uint64_t max_probe_depth;
+	/* Bucket locks taken, how many of those were already held (a failed
+	   trylock) and how long we waited for them in total. */
+	uint64_t lock_acquisitions;
+	uint64_t lock_contended;
+	uint64_t lock_wait_nsec;
+	/* Failed compare-and-swaps, on a bucket head in lock-free mode or on a
+	   value in `upsert`. */
+	uint64_t cas_failures;
+	/* Only set with a filter. Its size, and how many of its bits are
+	   set. */
+	uint64_t filter_bytes;
+	uint64_t filter_bits_set;
+	/* Lookups of a missing key the filter answered, and ones it let through
+	   to the bucket anyway. */
+	uint64_t filter_negatives;
+	uint64_t filter_false_positives;
+	/* Only counted with an `insert_buffer`. Flushes, and the locks they took
+	   (in lock-free mode, the buckets they visited). */
+	uint64_t buffer_flushes;
+	uint64_t buffer_flush_locks;
+};
+
+/* Returns the short name of a lock layout, used by pht-tester. */
+const char *hash_table_v2_lock_name(enum hash_table_v2_lock lock);
+/* Looks up a lock layout by its short name, returns whether it was found. */
+bool hash_table_v2_parse_lock(const char *name, enum hash_table_v2_lock *lock);
 
 struct hash_table_v2;
 struct hash_table_v2 *hash_table_v2_create();
+struct hash_table_v2 *hash_table_v2_create_with_options(const struct hash_table_v2_options *options);
 void hash_table_v2_add_entry(struct hash_table_v2 *hash_table,
                              const char *key,
                              uint32_t value);
 bool hash_table_v2_contains(struct hash_table_v2 *hash_table,
                             const char *key);
+/* Makes the calling thread's buffered inserts visible to every thread. Does
+   nothing unless the table has an `insert_buffer`. Inserts that are never
+   flushed are dropped by `hash_table_v2_destroy`. Lookups, `get_value` and
+   the batch calls also see the calling thread's own buffered inserts,
+   `remove`, `upsert` and `fetch_add` flush them first, and `foreach`,
+   `save` and `stats` only see flushed ones. */
+void hash_table_v2_flush(struct hash_table_v2 *hash_table);
 uint32_t hash_table_v2_get_value(struct hash_table_v2 *hash_table,
                                  const char* key);
+/* Sets the value of `key` to `function(exists, value, context)`, where
+   `exists` says whether the key was in the table and `value` is its current
+   value (0 if it wasn't), and returns the new value. The update is atomic
+   against other upserts of the same key, so `function` may be called more
+   than once if they race and must not have side effects. */
+uint32_t hash_table_v2_upsert(struct hash_table_v2 *hash_table,
+                              const char *key,
+                              uint32_t (*function)(bool exists, uint32_t value, void *context),
+                              void *context);
+/* Atomically adds `delta` to the value of `key`, inserting it with a value
+   of `delta` if it isn't there yet, and returns the value before the add (0
+   for a new key). */
+uint32_t hash_table_v2_fetch_add(struct hash_table_v2 *hash_table,
+                                 const char *key,
+                                 uint32_t delta);
+/* Removes the key from the hash table, returns whether it was there. Safe to
+   call concurrently with every other call. The entry's memory is reused once
+   no concurrent lookup can still be reading it. */
+bool hash_table_v2_remove(struct hash_table_v2 *hash_table,
+                          const char *key);
+/* Batch versions of the calls above, for `count` keys at a time. They are
+   faster than calling the single key versions in a loop because they overlap
+   the cache misses of different keys. */
+void hash_table_v2_add_entries(struct hash_table_v2 *hash_table,
+                               const char *const *keys,
+                               const uint32_t *values,
+                               size_t count);
+void hash_table_v2_contains_many(struct hash_table_v2 *hash_table,
+                                 const char *const *keys,
+                                 bool *results,
+                                 size_t count);
+void hash_table_v2_get_values(struct hash_table_v2 *hash_table,
+                              const char *const *keys,
+                              uint32_t *values,
+                              size_t count);
+/* Fills in `stats`. Safe to call while other threads use the table, the
+   counts are then only roughly consistent with each other. */
+void hash_table_v2_stats(struct hash_table_v2 *hash_table,
+                         struct hash_table_v2_stats *stats);
+/* Calls `function` for every (key, value) in the table, in no particular
+   order. Safe to call while other threads add and remove entries: an entry
+   that is in the table for the whole walk is visited exactly once, one
+   added or removed meanwhile may or may not be. `function` runs while the
+   entry is protected from reclamation, so it must not call back into the
+   table, and `key` is only valid until it returns. */
+void hash_table_v2_foreach(struct hash_table_v2 *hash_table,
+                           void (*function)(const char *key, uint32_t value, void *context),
+                           void *context);
+/* Same as `hash_table_v2_foreach`, but splits the buckets into
+   `partition_count` ranges and walks each on its own thread, returning once
+   they all finished. Partition `i` passes `contexts[i]` to `function`, so
+   every thread can accumulate into its own context without locking. */
+void hash_table_v2_foreach_partition(struct hash_table_v2 *hash_table,
+                                     uint32_t partition_count,
+                                     void (*function)(const char *key, uint32_t value, void *context),
+                                     void **contexts);
+/* Writes a snapshot of the table to `path`, see `hash-table-snapshot.h`.
+   Returns false with `errno` set if that failed. Safe to call while other
+   threads use the table, an entry added or removed meanwhile may or may
+   not be in the snapshot. */
+bool hash_table_v2_save(struct hash_table_v2 *hash_table,
+                        const char *path);
 void hash_table_v2_destroy(struct hash_table_v2 *hash_table);
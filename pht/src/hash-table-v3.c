@@ -0,0 +1,200 @@
+#include "hash-table-v3.h"
+
+#include "hash-table-snapshot.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* Instead of chaining `list_entry` nodes, v3 uses open addressing with linear
+   probing. The slots are stored as a struct of arrays: a probe only reads the
+   `fingerprints` array (64 slots per cache line) and, on a fingerprint match,
+   the full 32-bit hash. The key itself is only dereferenced when both match,
+   so a miss almost never touches the key's memory. This table is not thread
+   safe, it is meant to be compared against `hash_table_base`. */
+
+/* A fingerprint of 0 marks an empty slot, every stored fingerprint has the top
+   bit set so it can never be 0. */
+#define FINGERPRINT_EMPTY 0
+
+/* Grow once the table is 7/8 full to keep the probe sequences short. */
+#define MAX_LOAD_NUMERATOR 7
+#define MAX_LOAD_DENOMINATOR 8
+
+struct hash_table_v3 {
+	size_t capacity;
+	size_t size;
+	uint8_t *fingerprints;
+	uint32_t *hashes;
+	const char **keys;
+	uint32_t *values;
+};
+
+/* The index comes from the low bits of the hash, the fingerprint from the
+   high bits so the two are as independent as possible. */
+static uint8_t get_fingerprint(uint32_t hash)
+{
+	return 0x80 | (hash >> 25);
+}
+
+static void allocate_slots(struct hash_table_v3 *hash_table, size_t capacity)
+{
+	hash_table->capacity = capacity;
+	hash_table->fingerprints = calloc(capacity, sizeof(uint8_t));
+	hash_table->hashes = calloc(capacity, sizeof(uint32_t));
+	hash_table->keys = calloc(capacity, sizeof(const char *));
+	hash_table->values = calloc(capacity, sizeof(uint32_t));
+	assert(hash_table->fingerprints != NULL);
+	assert(hash_table->hashes != NULL);
+	assert(hash_table->keys != NULL);
+	assert(hash_table->values != NULL);
+}
+
+static void free_slots(struct hash_table_v3 *hash_table)
+{
+	free(hash_table->fingerprints);
+	free(hash_table->hashes);
+	free(hash_table->keys);
+	free(hash_table->values);
+}
+
+struct hash_table_v3 *hash_table_v3_create_with_capacity(size_t capacity)
+{
+	size_t slots = 2;
+	while (slots < capacity) {
+		slots *= 2;
+	}
+	struct hash_table_v3 *hash_table = calloc(1, sizeof(struct hash_table_v3));
+	assert(hash_table != NULL);
+	allocate_slots(hash_table, slots);
+	return hash_table;
+}
+
+struct hash_table_v3 *hash_table_v3_create()
+{
+	return hash_table_v3_create_with_capacity(HASH_TABLE_CAPACITY);
+}
+
+/* Returns the slot holding `key`, or the empty slot where it would be
+   inserted. The capacity is always a power of two and never full, so the
+   probe always terminates. */
+static size_t find_slot(struct hash_table_v3 *hash_table,
+                        const char *key,
+                        uint32_t hash)
+{
+	size_t mask = hash_table->capacity - 1;
+	uint8_t fingerprint = get_fingerprint(hash);
+	size_t i = hash & mask;
+	while (true) {
+		uint8_t current = hash_table->fingerprints[i];
+		if (current == FINGERPRINT_EMPTY) {
+			return i;
+		}
+		if (current == fingerprint
+		    && hash_table->hashes[i] == hash
+		    && strcmp(hash_table->keys[i], key) == 0) {
+			return i;
+		}
+		i = (i + 1) & mask;
+	}
+}
+
+/* Doubles the capacity and reinserts every entry. The stored hashes mean we
+   never need to rehash a key. */
+static void grow(struct hash_table_v3 *hash_table)
+{
+	struct hash_table_v3 old = *hash_table;
+	allocate_slots(hash_table, old.capacity * 2);
+	size_t mask = hash_table->capacity - 1;
+	for (size_t i = 0; i < old.capacity; ++i) {
+		if (old.fingerprints[i] == FINGERPRINT_EMPTY) {
+			continue;
+		}
+		size_t j = old.hashes[i] & mask;
+		while (hash_table->fingerprints[j] != FINGERPRINT_EMPTY) {
+			j = (j + 1) & mask;
+		}
+		hash_table->fingerprints[j] = old.fingerprints[i];
+		hash_table->hashes[j] = old.hashes[i];
+		hash_table->keys[j] = old.keys[i];
+		hash_table->values[j] = old.values[i];
+	}
+	free_slots(&old);
+}
+
+bool hash_table_v3_contains(struct hash_table_v3 *hash_table,
+                            const char *key)
+{
+	assert(key != NULL);
+	size_t i = find_slot(hash_table, key, bernstein_hash(key));
+	return hash_table->fingerprints[i] != FINGERPRINT_EMPTY;
+}
+
+void hash_table_v3_add_entry(struct hash_table_v3 *hash_table,
+                             const char *key,
+                             uint32_t value)
+{
+	assert(key != NULL);
+	uint32_t hash = bernstein_hash(key);
+	size_t i = find_slot(hash_table, key, hash);
+
+	/* Update the value if it already exists */
+	if (hash_table->fingerprints[i] != FINGERPRINT_EMPTY) {
+		hash_table->values[i] = value;
+		return;
+	}
+
+	if ((hash_table->size + 1) * MAX_LOAD_DENOMINATOR
+	    > hash_table->capacity * MAX_LOAD_NUMERATOR) {
+		grow(hash_table);
+		i = find_slot(hash_table, key, hash);
+	}
+
+	hash_table->fingerprints[i] = get_fingerprint(hash);
+	hash_table->hashes[i] = hash;
+	hash_table->keys[i] = key;
+	hash_table->values[i] = value;
+	++hash_table->size;
+}
+
+uint32_t hash_table_v3_get_value(struct hash_table_v3 *hash_table,
+                                 const char *key)
+{
+	assert(key != NULL);
+	size_t i = find_slot(hash_table, key, bernstein_hash(key));
+	assert(hash_table->fingerprints[i] != FINGERPRINT_EMPTY);
+	return hash_table->values[i];
+}
+
+void hash_table_v3_foreach(struct hash_table_v3 *hash_table,
+                           void (*function)(const char *key, uint32_t value, void *context),
+                           void *context)
+{
+	for (size_t i = 0; i < hash_table->capacity; ++i) {
+		if (hash_table->fingerprints[i] != FINGERPRINT_EMPTY) {
+			function(hash_table->keys[i], hash_table->values[i], context);
+		}
+	}
+}
+
+static void add_to_snapshot(const char *key, uint32_t value, void *context)
+{
+	hash_table_snapshot_builder_add(context, key, value);
+}
+
+bool hash_table_v3_save(struct hash_table_v3 *hash_table,
+                        const char *path)
+{
+	struct hash_table_snapshot_builder *builder =
+		hash_table_snapshot_builder_create(HASH_FUNCTION_BERNSTEIN);
+	hash_table_v3_foreach(hash_table, add_to_snapshot, builder);
+	bool ok = hash_table_snapshot_builder_write(builder, path);
+	hash_table_snapshot_builder_destroy(builder);
+	return ok;
+}
+
+void hash_table_v3_destroy(struct hash_table_v3 *hash_table)
+{
+	free_slots(hash_table);
+	free(hash_table);
+}
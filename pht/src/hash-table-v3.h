@@ -0,0 +1,29 @@
+#pragma once
+
+#include "hash-table-common.h"
+
+#include <stdbool.h>
+#include <stddef.h>
+
+struct hash_table_v3;
+struct hash_table_v3 *hash_table_v3_create();
+/* Starts with `capacity` slots, rounded up to a power of two, instead of
+   `HASH_TABLE_CAPACITY`. The table still grows as needed. */
+struct hash_table_v3 *hash_table_v3_create_with_capacity(size_t capacity);
+void hash_table_v3_add_entry(struct hash_table_v3 *hash_table,
+                             const char *key,
+                             uint32_t value);
+bool hash_table_v3_contains(struct hash_table_v3 *hash_table,
+                            const char *key);
+uint32_t hash_table_v3_get_value(struct hash_table_v3 *hash_table,
+                                 const char* key);
+/* Calls `function` for every (key, value) in the table, in no particular
+   order. The table must not be modified while iterating. */
+void hash_table_v3_foreach(struct hash_table_v3 *hash_table,
+                           void (*function)(const char *key, uint32_t value, void *context),
+                           void *context);
+/* Writes a snapshot of the table to `path`, see `hash-table-snapshot.h`.
+   Returns false with `errno` set if that failed. */
+bool hash_table_v3_save(struct hash_table_v3 *hash_table,
+                        const char *path);
+void hash_table_v3_destroy(struct hash_table_v3 *hash_table);
@@ -0,0 +1,663 @@
+#include "hash-table-v1.h"
+#include "hash-table-v2.h"
+#include "hash-table-resizable.h"
+#include "hash-table-cuckoo.h"
+
+#include <argp.h>
+#include <assert.h>
+#include <errno.h>
+#include <locale.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/* A benchmark harness for the thread safe tables. Every thread runs a
+   sequence of lookups (`contains`) and inserts (`add_entry`) on keys drawn
+   from a distribution, and every operation is timed on its own with
+   `clock_gettime`, so besides the throughput we get latency percentiles.
+   Timing each operation costs a few tens of nanoseconds, which is included
+   in the latencies but not subtracted from the throughput either, so
+   compare tables against each other rather than against pht-tester.
+
+   Each configuration is run for `warmup` untimed trials followed by
+   `trials` timed ones, each on a freshly created table. Results are printed
+   one row per trial, as text, JSON or CSV. */
+
+enum distribution {
+	DISTRIBUTION_UNIFORM,
+	DISTRIBUTION_ZIPF,
+	DISTRIBUTION_SEQUENTIAL,
+	DISTRIBUTION_COUNT,
+};
+
+enum format {
+	FORMAT_TEXT,
+	FORMAT_JSON,
+	FORMAT_CSV,
+};
+
+struct arguments {
+	uint32_t threads;
+	/* Size of the key space. */
+	uint32_t keys;
+	/* Operations per thread and trial. */
+	uint32_t operations;
+	/* Length of every key, not counting the terminating 0. */
+	uint32_t key_length;
+	/* Percentage of operations that are lookups, the rest are inserts. */
+	uint32_t read_ratio;
+	/* Percentage of the key space inserted before the timed operations. */
+	uint32_t preload;
+	uint32_t warmup;
+	uint32_t trials;
+	uint64_t seed;
+	enum distribution distribution;
+	/* Skew of the Zipfian distribution, in (0, 1). */
+	double theta;
+	enum format format;
+	/* Table to run, or `NULL` for all of them. */
+	const char *table;
+};
+
+/* Keys for the options that only have a long name. */
+enum {
+	OPTION_THETA = 0x100,
+	OPTION_SEED,
+	OPTION_TABLE,
+};
+
+static struct argp_option options[] = {
+	{ "threads", 't', "NUM", 0, "Number of threads.", 0},
+	{ "keys", 'k', "NUM", 0, "Number of distinct keys.", 0},
+	{ "operations", 'o', "NUM", 0, "Operations per thread and trial.", 0},
+	{ "key-length", 'l', "NUM", 0, "Length of every key.", 0},
+	{ "read-ratio", 'r', "PERCENT", 0, "Percentage of lookups, the rest are inserts.", 0},
+	{ "preload", 'p', "PERCENT", 0, "Percentage of the keys inserted before timing.", 0},
+	{ "warmup", 'w', "NUM", 0, "Untimed trials before the timed ones.", 0},
+	{ "trials", 'n', "NUM", 0, "Timed trials.", 0},
+	{ "distribution", 'd', "NAME", 0, "Key distribution (uniform, zipf or sequential).", 0},
+	{ "theta", OPTION_THETA, "NUM", 0, "Skew of the zipf distribution, between 0 and 1.", 0},
+	{ "seed", OPTION_SEED, "NUM", 0, "Seed for the key and operation choices.", 0},
+	{ "table", OPTION_TABLE, "NAME", 0, "Only run this table.", 0},
+	{ "format", 'f', "NAME", 0, "Output format (text, json or csv).", 0},
+	{ 0 }
+};
+
+static uint32_t parse_uint32_t(const char *string)
+{
+	char *end;
+	errno = 0;
+	unsigned long value = strtoul(string, &end, 10);
+	if (errno != 0 || end == string || *end != 0 || value > UINT32_MAX) {
+		exit(EINVAL);
+	}
+	return value;
+}
+
+static uint32_t parse_percent(const char *string)
+{
+	uint32_t percent = parse_uint32_t(string);
+	if (percent > 100) {
+		exit(EINVAL);
+	}
+	return percent;
+}
+
+static const char *get_distribution_name(enum distribution distribution)
+{
+	switch (distribution) {
+	case DISTRIBUTION_ZIPF:
+		return "zipf";
+	case DISTRIBUTION_SEQUENTIAL:
+		return "sequential";
+	default:
+		return "uniform";
+	}
+}
+
+static error_t parse_opt(int key, char *arg, struct argp_state *state)
+{
+	struct arguments *arguments = state->input;
+	switch (key) {
+	case 't':
+		arguments->threads = parse_uint32_t(arg);
+		break;
+	case 'k':
+		arguments->keys = parse_uint32_t(arg);
+		break;
+	case 'o':
+		arguments->operations = parse_uint32_t(arg);
+		break;
+	case 'l':
+		arguments->key_length = parse_uint32_t(arg);
+		break;
+	case 'r':
+		arguments->read_ratio = parse_percent(arg);
+		break;
+	case 'p':
+		arguments->preload = parse_percent(arg);
+		break;
+	case 'w':
+		arguments->warmup = parse_uint32_t(arg);
+		break;
+	case 'n':
+		arguments->trials = parse_uint32_t(arg);
+		break;
+	case 'd': {
+		int i = 0;
+		while (i < DISTRIBUTION_COUNT && strcmp(arg, get_distribution_name(i)) != 0) {
+			++i;
+		}
+		if (i == DISTRIBUTION_COUNT) {
+			exit(EINVAL);
+		}
+		arguments->distribution = i;
+		break;
+	}
+	case OPTION_THETA: {
+		char *end;
+		arguments->theta = strtod(arg, &end);
+		if (end == arg || *end != 0 || !(arguments->theta > 0 && arguments->theta < 1)) {
+			exit(EINVAL);
+		}
+		break;
+	}
+	case OPTION_SEED:
+		arguments->seed = parse_uint32_t(arg);
+		break;
+	case OPTION_TABLE:
+		arguments->table = arg;
+		break;
+	case 'f':
+		if (strcmp(arg, "text") == 0) {
+			arguments->format = FORMAT_TEXT;
+		}
+		else if (strcmp(arg, "json") == 0) {
+			arguments->format = FORMAT_JSON;
+		}
+		else if (strcmp(arg, "csv") == 0) {
+			arguments->format = FORMAT_CSV;
+		}
+		else {
+			exit(EINVAL);
+		}
+		break;
+	}
+	return 0;
+}
+
+static struct arguments arguments;
+static char *keys;
+
+static const char *get_key(uint32_t index)
+{
+	return keys + (size_t) index * (arguments.key_length + 1);
+}
+
+/* Every key is its index in decimal, padded with zeros to `key_length`. */
+static void generate_keys(void)
+{
+	int digits = snprintf(NULL, 0, "%u", arguments.keys - 1);
+	if (arguments.key_length < (uint32_t) digits) {
+		fprintf(stderr, "--key-length must be at least %d for %u keys\n",
+		        digits, arguments.keys);
+		exit(EINVAL);
+	}
+	keys = malloc((size_t) arguments.keys * (arguments.key_length + 1));
+	assert(keys != NULL);
+	for (uint32_t i = 0; i < arguments.keys; ++i) {
+		snprintf(keys + (size_t) i * (arguments.key_length + 1), arguments.key_length + 1,
+		         "%0*u", (int) arguments.key_length, i);
+	}
+}
+
+/* The tables, behind one interface. Only tables that are safe to use from
+   several threads at once are here. */
+struct table {
+	const char *name;
+	void *(*create)(void);
+	void (*add_entry)(void *hash_table, const char *key, uint32_t value);
+	bool (*contains)(void *hash_table, const char *key);
+	void (*destroy)(void *hash_table);
+};
+
+static void *create_v1(void)
+{
+	return hash_table_v1_create();
+}
+
+static void *create_v1_optimistic(void)
+{
+	struct hash_table_v1_options options = { .optimistic = true };
+	return hash_table_v1_create_with_options(&options);
+}
+
+static void add_entry_v1(void *hash_table, const char *key, uint32_t value)
+{
+	hash_table_v1_add_entry(hash_table, key, value);
+}
+
+static bool contains_v1(void *hash_table, const char *key)
+{
+	return hash_table_v1_contains(hash_table, key);
+}
+
+static void destroy_v1(void *hash_table)
+{
+	hash_table_v1_destroy(hash_table);
+}
+
+static void *create_v2(void)
+{
+	return hash_table_v2_create();
+}
+
+static void *create_v2_lock_free(void)
+{
+	struct hash_table_v2_options options = { .lock_free = true };
+	return hash_table_v2_create_with_options(&options);
+}
+
+static void add_entry_v2(void *hash_table, const char *key, uint32_t value)
+{
+	hash_table_v2_add_entry(hash_table, key, value);
+}
+
+static bool contains_v2(void *hash_table, const char *key)
+{
+	return hash_table_v2_contains(hash_table, key);
+}
+
+static void destroy_v2(void *hash_table)
+{
+	hash_table_v2_destroy(hash_table);
+}
+
+static void *create_resizable(void)
+{
+	return hash_table_resizable_create();
+}
+
+static void add_entry_resizable(void *hash_table, const char *key, uint32_t value)
+{
+	hash_table_resizable_add_entry(hash_table, key, value);
+}
+
+static bool contains_resizable(void *hash_table, const char *key)
+{
+	return hash_table_resizable_contains(hash_table, key);
+}
+
+static void destroy_resizable(void *hash_table)
+{
+	hash_table_resizable_destroy(hash_table);
+}
+
+static void *create_cuckoo(void)
+{
+	return hash_table_cuckoo_create();
+}
+
+static void add_entry_cuckoo(void *hash_table, const char *key, uint32_t value)
+{
+	hash_table_cuckoo_add_entry(hash_table, key, value);
+}
+
+static bool contains_cuckoo(void *hash_table, const char *key)
+{
+	return hash_table_cuckoo_contains(hash_table, key);
+}
+
+static void destroy_cuckoo(void *hash_table)
+{
+	hash_table_cuckoo_destroy(hash_table);
+}
+
+static const struct table tables[] = {
+	{ "v1", create_v1, add_entry_v1, contains_v1, destroy_v1 },
+	{ "v1-optimistic", create_v1_optimistic, add_entry_v1, contains_v1, destroy_v1 },
+	{ "v2", create_v2, add_entry_v2, contains_v2, destroy_v2 },
+	{ "v2-lock-free", create_v2_lock_free, add_entry_v2, contains_v2, destroy_v2 },
+	{ "resizable", create_resizable, add_entry_resizable, contains_resizable, destroy_resizable },
+	{ "cuckoo", create_cuckoo, add_entry_cuckoo, contains_cuckoo, destroy_cuckoo },
+};
+
+#define TABLE_COUNT (sizeof(tables) / sizeof(tables[0]))
+
+/* splitmix64, every thread has its own state. */
+static uint64_t next_random(uint64_t *state)
+{
+	uint64_t z = (*state += 0x9e3779b97f4a7c15ull);
+	z = (z ^ (z >> 30)) * 0xbf58476d1ce4e5b9ull;
+	z = (z ^ (z >> 27)) * 0x94d049bb133111ebull;
+	return z ^ (z >> 31);
+}
+
+/* Uniform in [0, 1). */
+static double next_random_double(uint64_t *state)
+{
+	return (next_random(state) >> 11) * (1.0 / (1ull << 53));
+}
+
+/* Zipfian ranks in [0, keys), rank 0 being the most popular, using the
+   method from Gray et al., "Quickly Generating Billion-Record Synthetic
+   Databases". The constants only depend on the arguments, so they are
+   computed once. */
+struct zipf {
+	double theta;
+	double alpha;
+	double zeta_n;
+	double eta;
+};
+
+static struct zipf zipf;
+
+static void zipf_init(uint32_t n, double theta)
+{
+	double zeta_n = 0;
+	for (uint32_t i = 1; i <= n; ++i) {
+		zeta_n += 1 / pow(i, theta);
+	}
+	double zeta_2 = 1 + 1 / pow(2, theta);
+	zipf.theta = theta;
+	zipf.alpha = 1 / (1 - theta);
+	zipf.zeta_n = zeta_n;
+	zipf.eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta_2 / zeta_n);
+}
+
+static uint32_t zipf_next(uint64_t *state, uint32_t n)
+{
+	double u = next_random_double(state);
+	double uz = u * zipf.zeta_n;
+	if (uz < 1) {
+		return 0;
+	}
+	if (uz < 1 + pow(0.5, zipf.theta)) {
+		return 1;
+	}
+	uint32_t rank = n * pow(zipf.eta * u - zipf.eta + 1, zipf.alpha);
+	return rank < n ? rank : n - 1;
+}
+
+struct operation {
+	uint32_t key;
+	bool read;
+};
+
+struct worker {
+	uint32_t index;
+	pthread_t thread;
+	struct operation *operations;
+	/* Nanoseconds each operation took. */
+	uint64_t *latencies;
+	/* When the worker started and finished its operations. */
+	uint64_t start;
+	uint64_t end;
+};
+
+static const struct table *table;
+static void *hash_table;
+static struct worker *workers;
+static pthread_barrier_t barrier;
+
+static void generate_operations(struct worker *worker, uint32_t trial)
+{
+	uint64_t state = arguments.seed ^ ((uint64_t) trial << 32) ^ worker->index;
+	/* Sequential threads start spread out over the key space. */
+	uint32_t next = (uint64_t) worker->index * arguments.keys / arguments.threads;
+	for (uint32_t i = 0; i < arguments.operations; ++i) {
+		struct operation *operation = &worker->operations[i];
+		switch (arguments.distribution) {
+		case DISTRIBUTION_ZIPF:
+			operation->key = zipf_next(&state, arguments.keys);
+			break;
+		case DISTRIBUTION_SEQUENTIAL:
+			operation->key = next;
+			next = next + 1 == arguments.keys ? 0 : next + 1;
+			break;
+		default:
+			operation->key = next_random(&state) % arguments.keys;
+			break;
+		}
+		operation->read = next_random(&state) % 100 < arguments.read_ratio;
+	}
+}
+
+static uint64_t now_nsec(void)
+{
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (uint64_t) time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+static void *run_worker(void *arg)
+{
+	struct worker *worker = arg;
+	pthread_barrier_wait(&barrier);
+	worker->start = now_nsec();
+	for (uint32_t i = 0; i < arguments.operations; ++i) {
+		struct operation *operation = &worker->operations[i];
+		const char *key = get_key(operation->key);
+		uint64_t start = now_nsec();
+		if (operation->read) {
+			table->contains(hash_table, key);
+		}
+		else {
+			table->add_entry(hash_table, key, operation->key);
+		}
+		worker->latencies[i] = now_nsec() - start;
+	}
+	worker->end = now_nsec();
+	return NULL;
+}
+
+struct result {
+	uint64_t nsec;
+	uint64_t p50;
+	uint64_t p99;
+	uint64_t p999;
+	uint64_t max;
+};
+
+static int compare_uint64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a;
+	uint64_t y = *(const uint64_t *) b;
+	return (x > y) - (x < y);
+}
+
+/* Nearest rank percentile of sorted values. */
+static uint64_t get_percentile(const uint64_t *sorted, size_t count, double percentile)
+{
+	size_t rank = count * percentile;
+	return sorted[rank < count ? rank : count - 1];
+}
+
+static struct result run_trial(uint32_t trial)
+{
+	hash_table = table->create();
+	uint32_t preload = (uint64_t) arguments.keys * arguments.preload / 100;
+	for (uint32_t i = 0; i < preload; ++i) {
+		table->add_entry(hash_table, get_key(i), i);
+	}
+	for (uint32_t i = 0; i < arguments.threads; ++i) {
+		generate_operations(&workers[i], trial);
+	}
+
+	pthread_barrier_init(&barrier, NULL, arguments.threads + 1);
+	for (uint32_t i = 0; i < arguments.threads; ++i) {
+		int err = pthread_create(&workers[i].thread, NULL, run_worker, &workers[i]);
+		if (err != 0) {
+			fprintf(stderr, "pthread_create: %s\n", strerror(err));
+			exit(err);
+		}
+	}
+	pthread_barrier_wait(&barrier);
+	/* The trial runs from the first worker starting to the last one
+	   finishing. Any of them can get past the barrier first. */
+	uint64_t start = UINT64_MAX;
+	uint64_t end = 0;
+	for (uint32_t i = 0; i < arguments.threads; ++i) {
+		pthread_join(workers[i].thread, NULL);
+		start = workers[i].start < start ? workers[i].start : start;
+		end = workers[i].end > end ? workers[i].end : end;
+	}
+	pthread_barrier_destroy(&barrier);
+	table->destroy(hash_table);
+
+	size_t count = (size_t) arguments.threads * arguments.operations;
+	uint64_t *latencies = malloc(count * sizeof(uint64_t));
+	assert(latencies != NULL);
+	for (uint32_t i = 0; i < arguments.threads; ++i) {
+		memcpy(&latencies[(size_t) i * arguments.operations], workers[i].latencies,
+		       arguments.operations * sizeof(uint64_t));
+	}
+	qsort(latencies, count, sizeof(uint64_t), compare_uint64);
+	struct result result = {
+		.nsec = end - start,
+		.p50 = get_percentile(latencies, count, 0.5),
+		.p99 = get_percentile(latencies, count, 0.99),
+		.p999 = get_percentile(latencies, count, 0.999),
+		.max = latencies[count - 1],
+	};
+	free(latencies);
+	return result;
+}
+
+static bool first_row = true;
+
+static void print_header(void)
+{
+	switch (arguments.format) {
+	case FORMAT_JSON:
+		printf("[");
+		break;
+	case FORMAT_CSV:
+		printf("table,distribution,threads,keys,key_length,read_ratio,trial,"
+		       "operations,nsec,ops_per_sec,p50_ns,p99_ns,p999_ns,max_ns\n");
+		break;
+	default:
+		printf("%u threads, %'u keys of length %u, %s, %u%% reads, %'u operations per thread\n",
+		       arguments.threads, arguments.keys, arguments.key_length,
+		       get_distribution_name(arguments.distribution), arguments.read_ratio,
+		       arguments.operations);
+		break;
+	}
+}
+
+static void print_row(uint32_t trial, const struct result *result)
+{
+	uint64_t operations = (uint64_t) arguments.threads * arguments.operations;
+	uint64_t ops_per_sec = result->nsec == 0 ? 0 : operations * 1000000000 / result->nsec;
+	switch (arguments.format) {
+	case FORMAT_JSON:
+		printf("%s\n  {\"table\": \"%s\", \"distribution\": \"%s\", \"threads\": %u, "
+		       "\"keys\": %u, \"key_length\": %u, \"read_ratio\": %u, \"trial\": %u, "
+		       "\"operations\": %lu, \"nsec\": %lu, \"ops_per_sec\": %lu, "
+		       "\"p50_ns\": %lu, \"p99_ns\": %lu, \"p999_ns\": %lu, \"max_ns\": %lu}",
+		       first_row ? "" : ",", table->name,
+		       get_distribution_name(arguments.distribution), arguments.threads,
+		       arguments.keys, arguments.key_length, arguments.read_ratio, trial,
+		       operations, result->nsec, ops_per_sec,
+		       result->p50, result->p99, result->p999, result->max);
+		break;
+	case FORMAT_CSV:
+		printf("%s,%s,%u,%u,%u,%u,%u,%lu,%lu,%lu,%lu,%lu,%lu,%lu\n",
+		       table->name, get_distribution_name(arguments.distribution),
+		       arguments.threads, arguments.keys, arguments.key_length,
+		       arguments.read_ratio, trial, operations, result->nsec, ops_per_sec,
+		       result->p50, result->p99, result->p999, result->max);
+		break;
+	default:
+		printf("Hash table %s, trial %u: %'lu usec\n", table->name, trial, result->nsec / 1000);
+		printf("  - %'lu ops/sec\n", ops_per_sec);
+		printf("  - latency p50 %'lu ns, p99 %'lu ns, p999 %'lu ns, max %'lu ns\n",
+		       result->p50, result->p99, result->p999, result->max);
+		break;
+	}
+	first_row = false;
+}
+
+static void print_footer(void)
+{
+	if (arguments.format == FORMAT_JSON) {
+		printf("\n]\n");
+	}
+}
+
+int main(int argc, char *argv[])
+{
+	arguments.threads = 4;
+	arguments.keys = 100000;
+	arguments.operations = 100000;
+	arguments.key_length = 16;
+	arguments.read_ratio = 90;
+	arguments.preload = 50;
+	arguments.warmup = 1;
+	arguments.trials = 3;
+	arguments.seed = 42;
+	arguments.theta = 0.99;
+
+	static struct argp argp = { 0 };
+	argp.options = options;
+	argp.parser = parse_opt;
+	argp_parse(&argp, argc, argv, 0, 0, &arguments);
+
+	if (arguments.threads == 0 || arguments.keys == 0
+	    || arguments.operations == 0 || arguments.trials == 0) {
+		exit(EINVAL);
+	}
+
+	setlocale(LC_ALL, "en_US.UTF-8");
+
+	generate_keys();
+	if (arguments.distribution == DISTRIBUTION_ZIPF) {
+		zipf_init(arguments.keys, arguments.theta);
+	}
+	workers = calloc(arguments.threads, sizeof(struct worker));
+	assert(workers != NULL);
+	for (uint32_t i = 0; i < arguments.threads; ++i) {
+		workers[i].index = i;
+		workers[i].operations = malloc(arguments.operations * sizeof(struct operation));
+		workers[i].latencies = malloc(arguments.operations * sizeof(uint64_t));
+		assert(workers[i].operations != NULL);
+		assert(workers[i].latencies != NULL);
+	}
+
+	if (arguments.table != NULL) {
+		size_t i = 0;
+		while (i < TABLE_COUNT && strcmp(arguments.table, tables[i].name) != 0) {
+			++i;
+		}
+		if (i == TABLE_COUNT) {
+			exit(EINVAL);
+		}
+	}
+
+	print_header();
+	for (size_t i = 0; i < TABLE_COUNT; ++i) {
+		table = &tables[i];
+		if (arguments.table != NULL && strcmp(arguments.table, table->name) != 0) {
+			continue;
+		}
+		for (uint32_t trial = 0; trial < arguments.warmup; ++trial) {
+			run_trial(trial);
+		}
+		for (uint32_t trial = 1; trial <= arguments.trials; ++trial) {
+			struct result result = run_trial(arguments.warmup + trial);
+			print_row(trial, &result);
+		}
+	}
+	print_footer();
+
+	for (uint32_t i = 0; i < arguments.threads; ++i) {
+		free(workers[i].operations);
+		free(workers[i].latencies);
+	}
+	free(workers);
+	free(keys);
+	return 0;
+}
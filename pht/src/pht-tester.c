@@ -1,13 +1,32 @@
+/* For `pthread_attr_setaffinity_np` and `sched_getaffinity`. */
+#define _GNU_SOURCE
+
 #include "hash-table-base.h"
 #include "hash-table-v1.h"
 #include "hash-table-v2.h"
+#include "hash-table-v3.h"
+#include "hash-table-swiss.h"
+#include "hash-table-resizable.h"
+#include "hash-table-cuckoo.h"
+#include "hash-table-sharded.h"
+#include "hash-table-snapshot.h"
+#include "hash-table-generic.h"
+#include "skip-list.h"
+#include "arena.h"
 
 #include <argp.h>
+#include <assert.h>
+#include <errno.h>
 #include <locale.h>
+#include <math.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <sys/time.h>
+#include <time.h>
+#include <unistd.h>
 
 char *entries;
 
@@ -18,11 +37,67 @@ void (*add_entry)(void *, const char *key, uint32_t value);
 struct arguments {
 	uint32_t threads;
 	uint32_t size;
+	/* Percentage of lookups in the mixed benchmark, which only runs if this
+	   was given. */
+	uint32_t read_ratio;
+	bool mixed;
+	/* Hash functions to compare, if `--hash` was given. */
+	bool compare_hashes;
+	/* Keys per batch in the batched benchmark, which only runs if this was
+	   given. */
+	uint32_t batch;
+	/* Keys each thread keeps in the table in the churn benchmark, which only
+	   runs if this was given. */
+	uint32_t churn;
+	bool all_hashes;
+	enum hash_function hash;
+	/* Lock layouts to compare, if `--lock` was given. */
+	bool compare_locks;
+	bool all_locks;
+	enum hash_table_v2_lock lock;
+	/* The keys only depend on this and their global index. */
+	uint32_t seed;
+	/* Distinct words in the word count benchmark, which only runs if this
+	   was given. */
+	uint32_t words;
+	/* Where to save a v2 snapshot, the snapshot benchmark only runs if this
+	   was given. */
+	const char *snapshot;
+	/* Percentage of lookups that miss in the filter benchmark, which only
+	   runs if this was given. */
+	uint32_t miss_ratio;
+	bool misses;
+	/* Also measure lookup latency of v2 and cuckoo. */
+	bool latency;
+	/* Print `hash_table_v2_stats` after the v2 benchmarks. */
+	bool stats;
+};
+
+/* Keys for the options that only have a long name. */
+enum {
+	OPTION_HASH = 0x100,
+	OPTION_LOCK,
+	OPTION_SEED,
+	OPTION_SNAPSHOT,
+	OPTION_STATS,
+	OPTION_MISSES,
+	OPTION_LATENCY,
 };
 
 static struct argp_option options[] = { 
 	{ "threads", 't', "NUM", 0, "Number of threads.", 0},
 	{ "size", 's', "NUM", 0, "Size per thread.", 0},
+	{ "read-ratio", 'r', "PERCENT", 0, "Also run a mixed benchmark with this percentage of lookups.", 0},
+	{ "churn", 'c', "NUM", 0, "Also run a churn benchmark, removing old keys to keep this many per thread.", 0},
+	{ "words", 'w', "NUM", 0, "Also run a word count benchmark with this many distinct words.", 0},
+	{ "batch", 'b', "NUM", 0, "Also run v2 with the batch calls, this many keys per call.", 0},
+	{ "hash", OPTION_HASH, "NAME", 0, "Compare a hash function (djb2, wyhash, crc32c or all).", 0},
+	{ "seed", OPTION_SEED, "NUM", 0, "Seed for generating the keys.", 0},
+	{ "snapshot", OPTION_SNAPSHOT, "PATH", 0, "Also save v2 as a snapshot to this file and look the keys up in it.", 0},
+	{ "misses", OPTION_MISSES, "PERCENT", 0, "Also run a lookup benchmark where this percentage of lookups miss, with and without a v2 filter.", 0},
+	{ "latency", OPTION_LATENCY, 0, 0, "Also report lookup latency percentiles of v2 and cuckoo, for uniform and Zipfian keys.", 0},
+	{ "stats", OPTION_STATS, 0, 0, "Count probes and lock contention in v2 and print them.", 0},
+	{ "lock", OPTION_LOCK, "NAME", 0, "Compare a v2 lock layout (mutex, padded, striped, ticket or all).", 0},
 	{ 0 } 
 };
 
@@ -73,6 +148,68 @@ static error_t parse_opt(int key, char *arg, struct argp_state *state) {
 	case 's':
 		arguments->size = parse_uint32_t(arg);
 		break;
+	case 'r':
+		arguments->read_ratio = parse_uint32_t(arg);
+		if (arguments->read_ratio > 100) {
+			exit(EINVAL);
+		}
+		arguments->mixed = true;
+		break;
+	case 'c':
+		arguments->churn = parse_uint32_t(arg);
+		if (arguments->churn == 0) {
+			exit(EINVAL);
+		}
+		break;
+	case 'w':
+		arguments->words = parse_uint32_t(arg);
+		if (arguments->words == 0) {
+			exit(EINVAL);
+		}
+		break;
+	case 'b':
+		arguments->batch = parse_uint32_t(arg);
+		if (arguments->batch == 0) {
+			exit(EINVAL);
+		}
+		break;
+	case OPTION_HASH:
+		arguments->compare_hashes = true;
+		if (strcmp(arg, "all") == 0) {
+			arguments->all_hashes = true;
+		}
+		else if (!parse_hash_function(arg, &arguments->hash)) {
+			exit(EINVAL);
+		}
+		break;
+	case OPTION_SEED:
+		arguments->seed = parse_uint32_t(arg);
+		break;
+	case OPTION_SNAPSHOT:
+		arguments->snapshot = arg;
+		break;
+	case OPTION_MISSES:
+		arguments->miss_ratio = parse_uint32_t(arg);
+		if (arguments->miss_ratio > 100) {
+			exit(EINVAL);
+		}
+		arguments->misses = true;
+		break;
+	case OPTION_LATENCY:
+		arguments->latency = true;
+		break;
+	case OPTION_STATS:
+		arguments->stats = true;
+		break;
+	case OPTION_LOCK:
+		arguments->compare_locks = true;
+		if (strcmp(arg, "all") == 0) {
+			arguments->all_locks = true;
+		}
+		else if (!hash_table_v2_parse_lock(arg, &arguments->lock)) {
+			exit(EINVAL);
+		}
+		break;
 	}   
 	return 0;
 }
@@ -98,157 +235,1307 @@ static unsigned long usec_diff(struct timeval *a, struct timeval *b)
 	return usec;
 }
 
-static struct hash_table_v1 *hash_table_v1;
-
-void *run_v1(void *arg) {
-	uint32_t thread = (uintptr_t) arg;
-	for (uint32_t j = 0; j < arguments.size; ++j) {
-		size_t global_index = get_global_index(thread, j);
-		char *string = get_string(global_index);
-		hash_table_v1_add_entry(hash_table_v1, string, global_index);
-	}
-	return NULL;
-}
-
-static struct hash_table_v2 *hash_table_v2;
-
-void *run_v2(void *arg) {
-	uint32_t thread = (uintptr_t) arg;
-	for (uint32_t j = 0; j < arguments.size; ++j) {
-		size_t global_index = get_global_index(thread, j);
-		char *string = get_string(global_index);
-		hash_table_v2_add_entry(hash_table_v2, string, global_index);
-	}
-	return NULL;
-}
-
-int main(int argc, char *argv[]) {
-	arguments.threads = 4;
-	arguments.size = 25000;
-  
-	// static struct argp argp = { options, parse_opt };
-	static struct argp argp = { 0 };
-	argp.options = options;
-	argp.parser = parse_opt;
-	argp_parse(&argp, argc, argv, 0, 0, &arguments);
-
-	setlocale(LC_ALL, "en_US.UTF-8");
-
-	data = calloc(arguments.threads * arguments.size, BYTES_PER_STRING);
-
+static void run_swiss(enum hash_table_swiss_engine engine)
+{
 	struct timeval start, end;
-
+	struct hash_table_swiss *hash_table = hash_table_swiss_create_with_engine(engine);
 	gettimeofday(&start, NULL);
-	srand(42);
 	for (uint32_t i = 0; i < arguments.threads; ++i) {
 		for (uint32_t j = 0; j < arguments.size; ++j) {
 			size_t global_index = get_global_index(i, j);
 			char *string = get_string(global_index);
-			for (uint32_t k = 0; k < (BYTES_PER_STRING - 1); ++k) {
-				int r = rand() % 52;
-				if (r < 26) {
-					string[k] = r + 0x41;
-				}
-				else {
-					string[k] = r + 0x47;
-				}
-			}
-			string[BYTES_PER_STRING - 1] = 0;
+			hash_table_swiss_add_entry(hash_table, string, global_index);
 		}
 	}
 	gettimeofday(&end, NULL);
-	printf("Generation: %'lu usec\n", usec_diff(&start, &end));
+	printf("Hash table swiss (%s): %'lu usec\n",
+	       hash_table_swiss_engine_name(hash_table), usec_diff(&start, &end));
 
-	struct hash_table_base *hash_table_base = hash_table_base_create();
-	gettimeofday(&start, NULL);
+	size_t missing = 0;
 	for (uint32_t i = 0; i < arguments.threads; ++i) {
 		for (uint32_t j = 0; j < arguments.size; ++j) {
 			size_t global_index = get_global_index(i, j);
 			char *string = get_string(global_index);
-			hash_table_base_add_entry(hash_table_base, string, global_index);
+			if (!hash_table_swiss_contains(hash_table, string)) {
+				++missing;
+			}
+		}
+	}
+	printf("  - %'lu missing\n", missing);
+	hash_table_swiss_destroy(hash_table);
+}
+
+HASH_TABLE_GENERIC(hash_table_string, const char *, uint32_t,
+                   hash_table_generic_hash_string, HASH_TABLE_GENERIC_EQUAL_STRING)
+HASH_TABLE_GENERIC(hash_table_u64, uint64_t, uint32_t,
+                   hash_table_generic_hash_u64, HASH_TABLE_GENERIC_EQUAL)
+
+/* Compares the generic table keyed by our strings against the same table
+   keyed by the integer global index. */
+static void test_generic(void)
+{
+	struct timeval start, end;
+	struct hash_table_string *hash_table_string = hash_table_string_create();
+	gettimeofday(&start, NULL);
+	for (uint32_t i = 0; i < arguments.threads; ++i) {
+		for (uint32_t j = 0; j < arguments.size; ++j) {
+			size_t global_index = get_global_index(i, j);
+			hash_table_string_add_entry(hash_table_string, get_string(global_index), global_index);
 		}
 	}
 	gettimeofday(&end, NULL);
-	printf("Hash table base: %'lu usec\n", usec_diff(&start, &end));
+	printf("Hash table generic (string keys): %'lu usec\n", usec_diff(&start, &end));
 
 	size_t missing = 0;
 	for (uint32_t i = 0; i < arguments.threads; ++i) {
 		for (uint32_t j = 0; j < arguments.size; ++j) {
-			size_t global_index = get_global_index(i, j);
-			char *string = get_string(global_index);
-			if (!hash_table_base_contains(hash_table_base, string)) {
+			if (!hash_table_string_contains(hash_table_string, get_string(get_global_index(i, j)))) {
 				++missing;
 			}
 		}
 	}
 	printf("  - %'lu missing\n", missing);
-	hash_table_base_destroy(hash_table_base);
+	hash_table_string_destroy(hash_table_string);
 
-	pthread_t *threads = calloc(arguments.threads, sizeof(pthread_t));
-
-	hash_table_v1 = hash_table_v1_create();
+	struct hash_table_u64 *hash_table_u64 = hash_table_u64_create();
 	gettimeofday(&start, NULL);
-	for (uintptr_t i = 0; i < arguments.threads; ++i) {
-		int err = pthread_create(&threads[i], NULL, run_v1, (void*) i);
-		if (err != 0) {
-			printf("pthread_create returned %d\n", err);
-			return err;
-		}
-	}
-	for (uintptr_t i = 0; i < arguments.threads; ++i) {
-		int err = pthread_join(threads[i], NULL);
-		if (err != 0) {
-			printf("pthread_join returned %d\n", err);
-			return err;
+	for (uint32_t i = 0; i < arguments.threads; ++i) {
+		for (uint32_t j = 0; j < arguments.size; ++j) {
+			size_t global_index = get_global_index(i, j);
+			hash_table_u64_add_entry(hash_table_u64, global_index, global_index);
 		}
 	}
 	gettimeofday(&end, NULL);
-	printf("Hash table v1: %'lu usec\n", usec_diff(&start, &end));
+	printf("Hash table generic (integer keys): %'lu usec\n", usec_diff(&start, &end));
 
 	missing = 0;
 	for (uint32_t i = 0; i < arguments.threads; ++i) {
 		for (uint32_t j = 0; j < arguments.size; ++j) {
 			size_t global_index = get_global_index(i, j);
-			char *string = get_string(global_index);
-			if (!hash_table_v1_contains(hash_table_v1, string)) {
+			if (hash_table_u64_get_value(hash_table_u64, global_index) != global_index) {
 				++missing;
 			}
 		}
 	}
 	printf("  - %'lu missing\n", missing);
-	hash_table_v1_destroy(hash_table_v1);
+	hash_table_u64_destroy(hash_table_u64);
+}
+
+/* Returns the current resident set size of the process in KiB. */
+static unsigned long get_rss_kib(void)
+{
+	FILE *file = fopen("/proc/self/statm", "r");
+	if (file == NULL) {
+		return 0;
+	}
+	unsigned long pages = 0;
+	unsigned long resident = 0;
+	if (fscanf(file, "%lu %lu", &pages, &resident) != 2) {
+		resident = 0;
+	}
+	fclose(file);
+	return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+/* Same size as the tables' `list_entry`. */
+struct node {
+	const char *key;
+	uint32_t value;
+	struct node *next;
+};
+
+/* Compares allocating (and freeing) one node per key with `calloc` against
+   allocating them from an arena, which is what the tables do. */
+static void test_allocation(void)
+{
+	struct timeval start, end;
+	size_t count = (size_t) arguments.threads * arguments.size;
+	struct node **nodes = calloc(count, sizeof(struct node *));
 
-	hash_table_v2 = hash_table_v2_create();
 	gettimeofday(&start, NULL);
-	for (uintptr_t i = 0; i < arguments.threads; ++i) {
-		int err = pthread_create(&threads[i], NULL, run_v2, (void*) i);
-		if (err != 0) {
-			printf("pthread_create returned %d\n", err);
-			return err;
-		}
+	for (size_t i = 0; i < count; ++i) {
+		nodes[i] = calloc(1, sizeof(struct node));
 	}
-	for (uintptr_t i = 0; i < arguments.threads; ++i) {
-		int err = pthread_join(threads[i], NULL);
-		if (err != 0) {
-			printf("pthread_join returned %d\n", err);
-			return err;
-		}
+	gettimeofday(&end, NULL);
+	printf("Allocation (calloc): %'lu usec\n", usec_diff(&start, &end));
+	gettimeofday(&start, NULL);
+	for (size_t i = 0; i < count; ++i) {
+		free(nodes[i]);
 	}
 	gettimeofday(&end, NULL);
-	printf("Hash table v2: %'lu usec\n", usec_diff(&start, &end));
+	printf("  - %'lu usec free\n", usec_diff(&start, &end));
 
-	missing = 0;
-	for (uint32_t i = 0; i < arguments.threads; ++i) {
-		for (uint32_t j = 0; j < arguments.size; ++j) {
-			size_t global_index = get_global_index(i, j);
-			char *string = get_string(global_index);
-			if (!hash_table_v2_contains(hash_table_v2, string)) {
-				++missing;
+	struct arena arena;
+	arena_init(&arena);
+	gettimeofday(&start, NULL);
+	for (size_t i = 0; i < count; ++i) {
+		nodes[i] = arena_alloc(&arena, sizeof(struct node));
+	}
+	gettimeofday(&end, NULL);
+	printf("Allocation (arena): %'lu usec\n", usec_diff(&start, &end));
+	gettimeofday(&start, NULL);
+	arena_destroy(&arena);
+	gettimeofday(&end, NULL);
+	printf("  - %'lu usec free\n", usec_diff(&start, &end));
+
+	free(nodes);
+}
+
+/* Prints the memory the process uses with a table still alive, then times
+   destroying it. */
+#define PRINT_RSS_AND_DESTROY(destroy, hash_table) \
+	do { \
+		struct timeval destroy_start, destroy_end; \
+		printf("  - %'lu KiB RSS\n", get_rss_kib()); \
+		gettimeofday(&destroy_start, NULL); \
+		destroy(hash_table); \
+		gettimeofday(&destroy_end, NULL); \
+		printf("  - %'lu usec destroy\n", usec_diff(&destroy_start, &destroy_end)); \
+	} while (0)
+
+static struct hash_table_v1 *hash_table_v1;
+
+void *run_v1(void *arg) {
+	uint32_t thread = (uintptr_t) arg;
+	for (uint32_t j = 0; j < arguments.size; ++j) {
+		size_t global_index = get_global_index(thread, j);
+		char *string = get_string(global_index);
+		hash_table_v1_add_entry(hash_table_v1, string, global_index);
+	}
+	return NULL;
+}
+
+static struct hash_table_v2 *hash_table_v2;
+
+void *run_v2(void *arg) {
+	uint32_t thread = (uintptr_t) arg;
+	for (uint32_t j = 0; j < arguments.size; ++j) {
+		size_t global_index = get_global_index(thread, j);
+		char *string = get_string(global_index);
+		hash_table_v2_add_entry(hash_table_v2, string, global_index);
+	}
+	/* Only does something with an insert buffer. */
+	hash_table_v2_flush(hash_table_v2);
+	return NULL;
+}
+
+static struct hash_table_resizable *hash_table_resizable;
+
+void *run_resizable(void *arg) {
+	uint32_t thread = (uintptr_t) arg;
+	for (uint32_t j = 0; j < arguments.size; ++j) {
+		size_t global_index = get_global_index(thread, j);
+		char *string = get_string(global_index);
+		hash_table_resizable_add_entry(hash_table_resizable, string, global_index);
+	}
+	return NULL;
+}
+
+static struct hash_table_cuckoo *hash_table_cuckoo;
+
+void *run_cuckoo(void *arg) {
+	uint32_t thread = (uintptr_t) arg;
+	for (uint32_t j = 0; j < arguments.size; ++j) {
+		size_t global_index = get_global_index(thread, j);
+		char *string = get_string(global_index);
+		hash_table_cuckoo_add_entry(hash_table_cuckoo, string, global_index);
+	}
+	return NULL;
+}
+
+static struct skip_list *skip_list;
+
+void *run_skip_list(void *arg) {
+	uint32_t thread = (uintptr_t) arg;
+	for (uint32_t j = 0; j < arguments.size; ++j) {
+		size_t global_index = get_global_index(thread, j);
+		char *string = get_string(global_index);
+		skip_list_add_entry(skip_list, string, global_index);
+	}
+	return NULL;
+}
+
+/* A small per-thread PRNG (xorshift64) for picking operations and keys, so
+   threads don't contend on the shared state of `rand()`. */
+static uint64_t next_random(uint64_t *state)
+{
+	uint64_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	*state = x;
+	return x;
+}
+
+/* Returns 64 random bits for the key at `global_index`. This is the
+   splitmix64 finalizer applied to a counter, so any thread can generate any
+   key on its own and the keys don't depend on which thread made them. */
+static uint64_t get_key_random(size_t global_index)
+{
+	uint64_t z = arguments.seed + (global_index + 1) * 0x9E3779B97F4A7C15ull;
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ull;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBull;
+	return z ^ (z >> 31);
+}
+
+/* Fills in the thread's own keys. `run_threads` pins thread `i` to the same
+   CPU in every run, so the slice is first touched on the CPU, and on a NUMA
+   machine the node, of the threads that later insert and look it up. */
+void *run_generate(void *arg) {
+	uint32_t thread = (uintptr_t) arg;
+	for (uint32_t j = 0; j < arguments.size; ++j) {
+		size_t global_index = get_global_index(thread, j);
+		char *string = get_string(global_index);
+		/* 52^7 < 2^64, so one random value covers every character. */
+		uint64_t random = get_key_random(global_index);
+		for (uint32_t k = 0; k < (BYTES_PER_STRING - 1); ++k) {
+			int r = random % 52;
+			random /= 52;
+			if (r < 26) {
+				string[k] = r + 0x41;
+			}
+			else {
+				string[k] = r + 0x47;
 			}
 		}
+		string[BYTES_PER_STRING - 1] = 0;
 	}
-	printf("  - %'lu missing\n", missing);
-	hash_table_v2_destroy(hash_table_v2);
+	return NULL;
+}
+
+/* Every thread does `arguments.size` operations. A `read_ratio` percentage of
+   them look up a random key from the whole data set, which may or may not
+   have been inserted yet. The rest insert the thread's next key. */
+void *run_v2_mixed(void *arg) {
+	uint32_t thread = (uintptr_t) arg;
+	uint64_t state = 0x9E3779B97F4A7C15ull * (thread + 1);
+	size_t total = (size_t) arguments.threads * arguments.size;
+	uint32_t inserted = 0;
+	for (uint32_t j = 0; j < arguments.size; ++j) {
+		if (next_random(&state) % 100 < arguments.read_ratio) {
+			char *string = get_string(next_random(&state) % total);
+			hash_table_v2_contains(hash_table_v2, string);
+		}
+		else {
+			size_t global_index = get_global_index(thread, inserted++);
+			char *string = get_string(global_index);
+			hash_table_v2_add_entry(hash_table_v2, string, global_index);
+		}
+	}
+	return NULL;
+}
+
+/* Same keys and values as `run_v2`, but passed to `add_entries`
+   `arguments.batch` at a time. */
+void *run_v2_batched(void *arg) {
+	uint32_t thread = (uintptr_t) arg;
+	const char **keys = calloc(arguments.batch, sizeof(const char *));
+	uint32_t *values = calloc(arguments.batch, sizeof(uint32_t));
+	for (uint32_t j = 0; j < arguments.size; j += arguments.batch) {
+		uint32_t count = 0;
+		for (; count < arguments.batch && j + count < arguments.size; ++count) {
+			size_t global_index = get_global_index(thread, j + count);
+			keys[count] = get_string(global_index);
+			values[count] = global_index;
+		}
+		hash_table_v2_add_entries(hash_table_v2, keys, values, count);
+	}
+	free(keys);
+	free(values);
+	return NULL;
+}
+
+/* Every thread inserts its keys in order, and once it has `arguments.churn`
+   of them in the table it removes its oldest key for every new one, so the
+   table stays the same size. */
+void *run_v2_churn(void *arg) {
+	uint32_t thread = (uintptr_t) arg;
+	for (uint32_t j = 0; j < arguments.size; ++j) {
+		size_t global_index = get_global_index(thread, j);
+		char *string = get_string(global_index);
+		hash_table_v2_add_entry(hash_table_v2, string, global_index);
+		if (j >= arguments.churn) {
+			char *old = get_string(get_global_index(thread, j - arguments.churn));
+			hash_table_v2_remove(hash_table_v2, old);
+		}
+	}
+	return NULL;
+}
+
+static struct hash_table_sharded *hash_table_sharded;
+
+/* Every thread inserts into its own shard. */
+void *run_sharded(void *arg) {
+	uint32_t thread = (uintptr_t) arg;
+	for (uint32_t j = 0; j < arguments.size; ++j) {
+		size_t global_index = get_global_index(thread, j);
+		char *string = get_string(global_index);
+		hash_table_sharded_add_entry(hash_table_sharded, thread, string, global_index);
+	}
+	return NULL;
+}
+
+/* In the filter benchmark, only the keys `run_v2_misses` should find are
+   inserted. */
+static bool is_miss(uint32_t index)
+{
+	return index % 100 < arguments.miss_ratio;
+}
+
+void *run_v2_insert_hits(void *arg) {
+	uint32_t thread = (uintptr_t) arg;
+	for (uint32_t j = 0; j < arguments.size; ++j) {
+		if (!is_miss(j)) {
+			size_t global_index = get_global_index(thread, j);
+			hash_table_v2_add_entry(hash_table_v2, get_string(global_index), global_index);
+		}
+	}
+	return NULL;
+}
+
+static size_t misses_found;
+
+/* Every thread looks up all of its keys, `miss_ratio` percent of which were
+   never inserted. */
+void *run_v2_misses(void *arg) {
+	uint32_t thread = (uintptr_t) arg;
+	size_t found = 0;
+	for (uint32_t j = 0; j < arguments.size; ++j) {
+		char *string = get_string(get_global_index(thread, j));
+		found += hash_table_v2_contains(hash_table_v2, string);
+	}
+	__atomic_fetch_add(&misses_found, found, __ATOMIC_RELAXED);
+	return NULL;
+}
+
+/* The table the latency benchmark looks keys up in. */
+static void *latency_table;
+static bool (*latency_contains)(void *hash_table, const char *key);
+/* One per lookup, indexed like the keys. */
+static uint64_t *latencies;
+
+static uint64_t get_nsec(void)
+{
+	struct timespec time;
+	clock_gettime(CLOCK_MONOTONIC, &time);
+	return (uint64_t) time.tv_sec * 1000000000 + time.tv_nsec;
+}
+
+/* Zipfian ranks in [0, `n`), rank `i` drawn with probability proportional
+   to 1 / (i + 1)^`theta`. Generated as in Gray et al., "Quickly Generating
+   Billion-Record Synthetic Databases", which is what YCSB uses. */
+struct zipf {
+	uint64_t n;
+	double theta;
+	double alpha;
+	double zeta_n;
+	double eta;
+};
+
+/* Looks keys up with a Zipfian distribution instead of a uniform one, if
+   set. */
+static bool latency_skewed;
+static struct zipf latency_zipf;
+
+static void zipf_init(struct zipf *zipf, uint64_t n, double theta)
+{
+	double zeta_2 = 1.0 + pow(0.5, theta);
+	double zeta_n = 0;
+	for (uint64_t i = 1; i <= n; ++i) {
+		zeta_n += 1.0 / pow(i, theta);
+	}
+	zipf->n = n;
+	zipf->theta = theta;
+	zipf->alpha = 1.0 / (1.0 - theta);
+	zipf->zeta_n = zeta_n;
+	zipf->eta = (1.0 - pow(2.0 / n, 1.0 - theta)) / (1.0 - zeta_2 / zeta_n);
+}
+
+static uint64_t zipf_next(const struct zipf *zipf, uint64_t *state)
+{
+	double u = (next_random(state) >> 11) * 0x1.0p-53;
+	double uz = u * zipf->zeta_n;
+	if (uz < 1.0) {
+		return 0;
+	}
+	if (uz < 1.0 + pow(0.5, zipf->theta)) {
+		return 1;
+	}
+	uint64_t rank = zipf->n * pow(zipf->eta * u - zipf->eta + 1.0, zipf->alpha);
+	return rank < zipf->n ? rank : zipf->n - 1;
+}
+
+/* Every thread looks up `arguments.size` random keys of the whole data set,
+   uniformly or skewed, and times each lookup on its own. The key of rank `i`
+   is the one at global index `i`, which hashes anywhere. */
+void *run_lookup_latency(void *arg) {
+	uint32_t thread = (uintptr_t) arg;
+	uint64_t state = 0x9E3779B97F4A7C15ull * (thread + 1);
+	size_t total = (size_t) arguments.threads * arguments.size;
+	for (uint32_t j = 0; j < arguments.size; ++j) {
+		size_t global_index = latency_skewed ? zipf_next(&latency_zipf, &state)
+		                                     : next_random(&state) % total;
+		char *string = get_string(global_index);
+		uint64_t start = get_nsec();
+		latency_contains(latency_table, string);
+		latencies[get_global_index(thread, j)] = get_nsec() - start;
+	}
+	return NULL;
+}
+
+static pthread_t *threads;
+
+/* CPUs this process may run on, thread `i` of every `run_threads` call is
+   pinned to `cpus[i % cpu_count]`. Nothing is pinned if `cpu_count` is 0. */
+static int *cpus;
+static uint32_t cpu_count;
+
+static void get_cpus(void)
+{
+	cpu_set_t set;
+	CPU_ZERO(&set);
+	if (sched_getaffinity(0, sizeof(set), &set) != 0) {
+		return;
+	}
+	cpus = malloc(CPU_COUNT(&set) * sizeof(int));
+	assert(cpus != NULL);
+	for (int cpu = 0; cpu < CPU_SETSIZE; ++cpu) {
+		if (CPU_ISSET(cpu, &set)) {
+			cpus[cpu_count++] = cpu;
+		}
+	}
+}
+
+/* Runs `run` on every thread, passing the thread number as the argument, and
+   returns how long it took for all of them to finish. */
+static unsigned long run_threads(void *(*run)(void *))
+{
+	struct timeval start, end;
+	gettimeofday(&start, NULL);
+	for (uintptr_t i = 0; i < arguments.threads; ++i) {
+		pthread_attr_t attr;
+		pthread_attr_init(&attr);
+		if (cpu_count > 0) {
+			cpu_set_t set;
+			CPU_ZERO(&set);
+			CPU_SET(cpus[i % cpu_count], &set);
+			pthread_attr_setaffinity_np(&attr, sizeof(set), &set);
+		}
+		int err = pthread_create(&threads[i], &attr, run, (void*) i);
+		pthread_attr_destroy(&attr);
+		if (err != 0) {
+			printf("pthread_create returned %d\n", err);
+			exit(err);
+		}
+	}
+	for (uintptr_t i = 0; i < arguments.threads; ++i) {
+		int err = pthread_join(threads[i], NULL);
+		if (err != 0) {
+			printf("pthread_join returned %d\n", err);
+			exit(err);
+		}
+	}
+	gettimeofday(&end, NULL);
+	return usec_diff(&start, &end);
+}
+
+static size_t count_missing_v2(void)
+{
+	size_t missing = 0;
+	for (uint32_t i = 0; i < arguments.threads; ++i) {
+		for (uint32_t j = 0; j < arguments.size; ++j) {
+			size_t global_index = get_global_index(i, j);
+			char *string = get_string(global_index);
+			if (!hash_table_v2_contains(hash_table_v2, string)) {
+				++missing;
+			}
+		}
+	}
+	return missing;
+}
+
+/* Creates `hash_table_v2`, with stats if `--stats` was given. */
+static void create_v2(const struct hash_table_v2_options *options)
+{
+	struct hash_table_v2_options stats_options = { 0 };
+	if (options != NULL) {
+		stats_options = *options;
+	}
+	stats_options.stats = arguments.stats;
+	hash_table_v2 = hash_table_v2_create_with_options(&stats_options);
+}
+
+static void print_v2_stats(void)
+{
+	if (!arguments.stats) {
+		return;
+	}
+	struct hash_table_v2_stats stats;
+	hash_table_v2_stats(hash_table_v2, &stats);
+	size_t empty = stats.chain_lengths[0];
+	printf("  - %'lu entries, %'lu of %'lu buckets empty, longest chain %'lu\n",
+	       stats.entries, empty, (size_t) HASH_TABLE_CAPACITY, stats.max_chain_length);
+	printf("  - %'lu lookups, %.2f probes per lookup, at most %'lu\n",
+	       stats.lookups,
+	       stats.lookups == 0 ? 0.0 : (double) stats.probes / stats.lookups,
+	       stats.max_probe_depth);
+	printf("  - %'lu locks taken, %'lu contended, %'lu usec waiting\n",
+	       stats.lock_acquisitions, stats.lock_contended, stats.lock_wait_nsec / 1000);
+	printf("  - %'lu CAS failures\n", stats.cas_failures);
+	if (stats.buffer_flushes != 0) {
+		printf("  - %'lu buffer flushes, %.1f locks per flush\n",
+		       stats.buffer_flushes, (double) stats.buffer_flush_locks / stats.buffer_flushes);
+	}
+	if (stats.filter_bytes != 0) {
+		uint64_t passed = stats.filter_negatives + stats.filter_false_positives;
+		printf("  - %'lu KiB filter, %.1f%% of its bits set\n",
+		       stats.filter_bytes / 1024,
+		       100.0 * stats.filter_bits_set / (stats.filter_bytes * 8));
+		printf("  - %'lu misses answered by the filter, %.2f%% false positives\n",
+		       stats.filter_negatives,
+		       passed == 0 ? 0.0 : 100.0 * stats.filter_false_positives / passed);
+	}
+}
+
+/* Times inserting with `run_v2_batched`, then times looking every key up
+   one at a time and in batches. */
+static void test_v2_batched(const char *name, const struct hash_table_v2_options *options)
+{
+	hash_table_v2 = hash_table_v2_create_with_options(options);
+	printf("Hash table %s, batches of %u: %'lu usec\n",
+	       name, arguments.batch, run_threads(run_v2_batched));
+
+	struct timeval start, end;
+	size_t count = (size_t) arguments.threads * arguments.size;
+	gettimeofday(&start, NULL);
+	size_t missing = count_missing_v2();
+	gettimeofday(&end, NULL);
+	printf("  - %'lu usec lookups one at a time, %'lu missing\n",
+	       usec_diff(&start, &end), missing);
+
+	const char **keys = calloc(arguments.batch, sizeof(const char *));
+	bool *results = calloc(arguments.batch, sizeof(bool));
+	missing = 0;
+	gettimeofday(&start, NULL);
+	for (size_t i = 0; i < count; i += arguments.batch) {
+		size_t batch = 0;
+		for (; batch < arguments.batch && i + batch < count; ++batch) {
+			keys[batch] = get_string(i + batch);
+		}
+		hash_table_v2_contains_many(hash_table_v2, keys, results, batch);
+		for (size_t j = 0; j < batch; ++j) {
+			missing += !results[j];
+		}
+	}
+	gettimeofday(&end, NULL);
+	printf("  - %'lu usec lookups in batches, %'lu missing\n",
+	       usec_diff(&start, &end), missing);
+	free(keys);
+	free(results);
+
+	hash_table_v2_destroy(hash_table_v2);
+}
+
+/* Times `run_v2_churn`, then checks that exactly each thread's newest
+   `arguments.churn` keys are left. */
+static void test_v2_churn(const char *name, const struct hash_table_v2_options *options)
+{
+	create_v2(options);
+	printf("Hash table %s, churn keeping %u per thread: %'lu usec\n",
+	       name, arguments.churn, run_threads(run_v2_churn));
+	print_v2_stats();
+
+	size_t missing = 0;
+	size_t unexpected = 0;
+	for (uint32_t i = 0; i < arguments.threads; ++i) {
+		for (uint32_t j = 0; j < arguments.size; ++j) {
+			char *string = get_string(get_global_index(i, j));
+			bool expected = j + arguments.churn >= arguments.size;
+			bool contains = hash_table_v2_contains(hash_table_v2, string);
+			missing += expected && !contains;
+			unexpected += !expected && contains;
+		}
+	}
+	printf("  - %'lu missing, %'lu unexpected\n", missing, unexpected);
+	PRINT_RSS_AND_DESTROY(hash_table_v2_destroy, hash_table_v2);
+}
+
+static size_t count_missing_sharded(void)
+{
+	size_t missing = 0;
+	for (uint32_t i = 0; i < arguments.threads; ++i) {
+		for (uint32_t j = 0; j < arguments.size; ++j) {
+			size_t global_index = get_global_index(i, j);
+			char *string = get_string(global_index);
+			if (!hash_table_sharded_contains(hash_table_sharded, string)) {
+				++missing;
+			}
+		}
+	}
+	return missing;
+}
+
+/* Times inserting into per-thread shards, then times looking every key up
+   before and after merging the shards. */
+static void test_sharded(void)
+{
+	hash_table_sharded = hash_table_sharded_create(arguments.threads, arguments.threads);
+	printf("Hash table sharded: %'lu usec\n", run_threads(run_sharded));
+
+	struct timeval start, end;
+	gettimeofday(&start, NULL);
+	size_t missing = count_missing_sharded();
+	gettimeofday(&end, NULL);
+	printf("  - %'lu usec lookups before merge, %'lu missing\n",
+	       usec_diff(&start, &end), missing);
+
+	gettimeofday(&start, NULL);
+	hash_table_sharded_merge_start(hash_table_sharded, arguments.threads);
+	hash_table_sharded_merge_wait(hash_table_sharded);
+	gettimeofday(&end, NULL);
+	printf("  - %'lu usec merge\n", usec_diff(&start, &end));
+
+	gettimeofday(&start, NULL);
+	missing = count_missing_sharded();
+	gettimeofday(&end, NULL);
+	printf("  - %'lu usec lookups after merge, %'lu missing\n",
+	       usec_diff(&start, &end), missing);
+	PRINT_RSS_AND_DESTROY(hash_table_sharded_destroy, hash_table_sharded);
+}
+
+/* Times `run_v2_mixed` on a v2 table created with `options`. */
+static void test_v2_mixed(const char *name, const struct hash_table_v2_options *options)
+{
+	create_v2(options);
+	unsigned long usec = run_threads(run_v2_mixed);
+	size_t operations = (size_t) arguments.threads * arguments.size;
+	printf("Hash table %s, %u%% reads: %'lu usec\n", name, arguments.read_ratio, usec);
+	printf("  - %'lu ops/sec\n", usec == 0 ? 0 : operations * 1000000 / usec);
+	print_v2_stats();
+	hash_table_v2_destroy(hash_table_v2);
+}
+
+/* Times `run_v2_misses` on a table holding only the keys that should be
+   found. */
+static void test_v2_misses(const char *name, const struct hash_table_v2_options *options)
+{
+	create_v2(options);
+	run_threads(run_v2_insert_hits);
+	misses_found = 0;
+	unsigned long usec = run_threads(run_v2_misses);
+	size_t lookups = (size_t) arguments.threads * arguments.size;
+	size_t expected = 0;
+	for (uint32_t j = 0; j < arguments.size; ++j) {
+		expected += !is_miss(j);
+	}
+	expected *= arguments.threads;
+	printf("Hash table %s, %u%% misses: %'lu usec\n", name, arguments.miss_ratio, usec);
+	printf("  - %'lu lookups/sec, %'lu found of %'lu\n",
+	       usec == 0 ? 0 : lookups * 1000000 / usec, misses_found, expected);
+	print_v2_stats();
+	PRINT_RSS_AND_DESTROY(hash_table_v2_destroy, hash_table_v2);
+}
+
+/* Checks that a walk sees its keys in order. */
+struct ordered_walk {
+	size_t count;
+	const char *previous;
+	bool sorted;
+};
+
+static void add_to_ordered_walk(const char *key, uint32_t value, void *context)
+{
+	(void) value;
+	struct ordered_walk *walk = context;
+	if (walk->previous != NULL && strcmp(walk->previous, key) >= 0) {
+		walk->sorted = false;
+	}
+	walk->previous = key;
+	++walk->count;
+}
+
+static int compare_strings(const void *a, const void *b)
+{
+	return strcmp(*(char *const *) a, *(char *const *) b);
+}
+
+/* Returns how many different keys start with `letter`. Two random keys can
+   be equal, and the skip list holds each only once. */
+static size_t count_keys_starting_with(char letter)
+{
+	size_t total = (size_t) arguments.threads * arguments.size;
+	char **keys = malloc(total * sizeof(char *));
+	assert(keys != NULL);
+	size_t count = 0;
+	for (size_t i = 0; i < total; ++i) {
+		if (get_string(i)[0] == letter) {
+			keys[count++] = get_string(i);
+		}
+	}
+	qsort(keys, count, sizeof(char *), compare_strings);
+	size_t distinct = 0;
+	for (size_t i = 0; i < count; ++i) {
+		if (i == 0 || strcmp(keys[i - 1], keys[i]) != 0) {
+			++distinct;
+		}
+	}
+	free(keys);
+	return distinct;
+}
+
+/* Times inserting every key into the skip list, which costs more than v2
+   since every insert walks O(log n) nodes, then times an ordered walk over
+   all of them and a prefix scan, which v2 can't do. */
+static void test_skip_list(void)
+{
+	skip_list = skip_list_create();
+	printf("Skip list: %'lu usec\n", run_threads(run_skip_list));
+
+	size_t missing = 0;
+	for (uint32_t i = 0; i < arguments.threads; ++i) {
+		for (uint32_t j = 0; j < arguments.size; ++j) {
+			if (!skip_list_contains(skip_list, get_string(get_global_index(i, j)))) {
+				++missing;
+			}
+		}
+	}
+	printf("  - %'lu missing\n", missing);
+
+	struct timeval start, end;
+	struct ordered_walk walk = { .sorted = true };
+	gettimeofday(&start, NULL);
+	skip_list_range(skip_list, NULL, NULL, add_to_ordered_walk, &walk);
+	gettimeofday(&end, NULL);
+	printf("  - %'lu usec ordered walk, %'lu keys, %s\n",
+	       usec_diff(&start, &end), walk.count, walk.sorted ? "sorted" : "NOT sorted");
+
+	/* Keys are letters, so about 1 in 52 starts with an "A". */
+	struct ordered_walk prefix = { .sorted = true };
+	gettimeofday(&start, NULL);
+	skip_list_range(skip_list, "A", "B", add_to_ordered_walk, &prefix);
+	gettimeofday(&end, NULL);
+	size_t expected = count_keys_starting_with('A');
+	printf("  - %'lu usec prefix scan, %'lu keys starting with A of %'lu, %s\n",
+	       usec_diff(&start, &end), prefix.count, expected,
+	       prefix.sorted ? "sorted" : "NOT sorted");
+	PRINT_RSS_AND_DESTROY(skip_list_destroy, skip_list);
+}
+
+/* Times `run_v1` on a v1 table created with `options`. */
+static void test_v1(const char *name, const struct hash_table_v1_options *options)
+{
+	hash_table_v1 = hash_table_v1_create_with_options(options);
+	printf("Hash table %s: %'lu usec\n", name, run_threads(run_v1));
+
+	size_t missing = 0;
+	for (uint32_t i = 0; i < arguments.threads; ++i) {
+		for (uint32_t j = 0; j < arguments.size; ++j) {
+			size_t global_index = get_global_index(i, j);
+			char *string = get_string(global_index);
+			if (!hash_table_v1_contains(hash_table_v1, string)) {
+				++missing;
+			}
+		}
+	}
+	printf("  - %'lu missing\n", missing);
+	PRINT_RSS_AND_DESTROY(hash_table_v1_destroy, hash_table_v1);
+}
+
+/* Times `run_v2` on a v2 table created with `options`. */
+static void test_v2(const char *name, const struct hash_table_v2_options *options)
+{
+	create_v2(options);
+	printf("Hash table %s: %'lu usec\n", name, run_threads(run_v2));
+	print_v2_stats();
+	printf("  - %'lu missing\n", count_missing_v2());
+	PRINT_RSS_AND_DESTROY(hash_table_v2_destroy, hash_table_v2);
+}
+
+/* An order independent checksum of a table's entries. */
+struct checksum {
+	size_t count;
+	uint64_t sum;
+};
+
+static void add_to_checksum(const char *key, uint32_t value, void *context)
+{
+	struct checksum *checksum = context;
+	++checksum->count;
+	checksum->sum += ((uint64_t) bernstein_hash(key) << 32) ^ value;
+}
+
+/* Times checksumming a v2 table with one thread, then with a partition per
+   thread. */
+static void test_foreach(void)
+{
+	struct timeval start, end;
+	hash_table_v2 = hash_table_v2_create();
+	run_threads(run_v2);
+
+	struct checksum checksum = { 0 };
+	gettimeofday(&start, NULL);
+	hash_table_v2_foreach(hash_table_v2, add_to_checksum, &checksum);
+	gettimeofday(&end, NULL);
+	printf("Hash table v2 foreach: %'lu usec\n", usec_diff(&start, &end));
+	printf("  - %'lu entries, checksum %016lx\n", checksum.count, checksum.sum);
+
+	struct checksum *checksums = calloc(arguments.threads, sizeof(struct checksum));
+	void **contexts = calloc(arguments.threads, sizeof(void *));
+	for (uint32_t i = 0; i < arguments.threads; ++i) {
+		contexts[i] = &checksums[i];
+	}
+	gettimeofday(&start, NULL);
+	hash_table_v2_foreach_partition(hash_table_v2, arguments.threads, add_to_checksum, contexts);
+	gettimeofday(&end, NULL);
+	struct checksum total = { 0 };
+	for (uint32_t i = 0; i < arguments.threads; ++i) {
+		total.count += checksums[i].count;
+		total.sum += checksums[i].sum;
+	}
+	printf("Hash table v2 foreach, %u partitions: %'lu usec\n",
+	       arguments.threads, usec_diff(&start, &end));
+	printf("  - %'lu entries, checksum %016lx\n", total.count, total.sum);
+	free(contexts);
+	free(checksums);
+	hash_table_v2_destroy(hash_table_v2);
+}
+
+/* Counts with `get_value` and `add_entry` instead of `fetch_add`, if set. */
+static bool word_count_naive;
+
+/* Every thread counts `arguments.size` words. Words are picked from the
+   first `arguments.words` keys, skewed towards the first ones like words in
+   a text. */
+void *run_v2_word_count(void *arg) {
+	uint32_t thread = (uintptr_t) arg;
+	uint64_t state = 0x9E3779B97F4A7C15ull * (thread + 1);
+	for (uint32_t j = 0; j < arguments.size; ++j) {
+		uint64_t a = next_random(&state) % arguments.words;
+		uint64_t b = next_random(&state) % arguments.words;
+		char *string = get_string(a * b / arguments.words);
+		if (!word_count_naive) {
+			hash_table_v2_fetch_add(hash_table_v2, string, 1);
+		}
+		else if (hash_table_v2_contains(hash_table_v2, string)) {
+			uint32_t count = hash_table_v2_get_value(hash_table_v2, string);
+			hash_table_v2_add_entry(hash_table_v2, string, count + 1);
+		}
+		else {
+			hash_table_v2_add_entry(hash_table_v2, string, 1);
+		}
+	}
+	return NULL;
+}
+
+/* Sums the counts, using a checksum's fields for the words and the total. */
+static void add_to_word_count(const char *key, uint32_t value, void *context)
+{
+	(void) key;
+	struct checksum *checksum = context;
+	++checksum->count;
+	checksum->sum += value;
+}
+
+/* Times counting words with `fetch_add` and with a lookup followed by an
+   insert. The total count shows the updates the second one loses when
+   threads race on the same word. */
+static void test_v2_word_count(const char *name,
+                               const struct hash_table_v2_options *options,
+                               bool naive)
+{
+	word_count_naive = naive;
+	create_v2(options);
+	unsigned long usec = run_threads(run_v2_word_count);
+	struct checksum checksum = { 0 };
+	hash_table_v2_foreach(hash_table_v2, add_to_word_count, &checksum);
+	printf("Hash table %s, word count (%s): %'lu usec\n",
+	       name, naive ? "get_value + add_entry" : "fetch_add", usec);
+	printf("  - %'lu words counted of %'lu, %'lu distinct\n",
+	       checksum.sum, (uint64_t) arguments.threads * arguments.size, checksum.count);
+	print_v2_stats();
+	hash_table_v2_destroy(hash_table_v2);
+}
+
+/* Times saving a v2 table as a snapshot, opening it and looking every key up
+   in it. */
+static void test_snapshot(void)
+{
+	struct timeval start, end;
+	hash_table_v2 = hash_table_v2_create();
+	run_threads(run_v2);
+
+	gettimeofday(&start, NULL);
+	if (!hash_table_v2_save(hash_table_v2, arguments.snapshot)) {
+		perror(arguments.snapshot);
+		exit(errno);
+	}
+	gettimeofday(&end, NULL);
+	hash_table_v2_destroy(hash_table_v2);
+	printf("Snapshot save: %'lu usec\n", usec_diff(&start, &end));
+
+	gettimeofday(&start, NULL);
+	struct hash_table_snapshot *snapshot = hash_table_snapshot_open_mmap(arguments.snapshot);
+	gettimeofday(&end, NULL);
+	if (snapshot == NULL) {
+		perror(arguments.snapshot);
+		exit(errno);
+	}
+	printf("Snapshot open: %'lu usec\n", usec_diff(&start, &end));
+	printf("  - %'lu entries\n", hash_table_snapshot_size(snapshot));
+
+	size_t missing = 0;
+	gettimeofday(&start, NULL);
+	for (uint32_t i = 0; i < arguments.threads; ++i) {
+		for (uint32_t j = 0; j < arguments.size; ++j) {
+			size_t global_index = get_global_index(i, j);
+			char *string = get_string(global_index);
+			if (!hash_table_snapshot_contains(snapshot, string)) {
+				++missing;
+			}
+		}
+	}
+	gettimeofday(&end, NULL);
+	printf("Snapshot lookups: %'lu usec\n", usec_diff(&start, &end));
+	printf("  - %'lu missing\n", missing);
+	hash_table_snapshot_close(snapshot);
+}
+
+static int compare_uint32(const void *a, const void *b)
+{
+	uint32_t x = *(const uint32_t *) a;
+	uint32_t y = *(const uint32_t *) b;
+	return (x > y) - (x < y);
+}
+
+static int compare_uint64(const void *a, const void *b)
+{
+	uint64_t x = *(const uint64_t *) a;
+	uint64_t y = *(const uint64_t *) b;
+	return (x > y) - (x < y);
+}
+
+/* Times `run_lookup_latency` on `latency_table` and prints the percentiles.
+   The clock reads are included in every latency. */
+static void test_lookup_latency(const char *name, bool skewed)
+{
+	size_t count = (size_t) arguments.threads * arguments.size;
+	latencies = malloc(count * sizeof(uint64_t));
+	assert(latencies != NULL);
+	latency_skewed = skewed;
+	run_threads(run_lookup_latency);
+	qsort(latencies, count, sizeof(uint64_t), compare_uint64);
+	printf("Hash table %s lookup latency (%s): p50 %'lu nsec, p99 %'lu nsec, p99.9 %'lu nsec, max %'lu nsec\n",
+	       name, skewed ? "zipfian" : "uniform",
+	       latencies[count / 2], latencies[count * 99 / 100],
+	       latencies[count * 999 / 1000], latencies[count - 1]);
+	free(latencies);
+	latencies = NULL;
+}
+
+static bool contains_v2(void *hash_table, const char *key)
+{
+	return hash_table_v2_contains(hash_table, key);
+}
+
+static bool contains_cuckoo(void *hash_table, const char *key)
+{
+	return hash_table_cuckoo_contains(hash_table, key);
+}
+
+/* A v2 chain holds about `threads * size / HASH_TABLE_CAPACITY` keys, a
+   cuckoo lookup reads at most two buckets. The tail shows the difference.
+   The skewed run looks up a few hot keys most of the time, like a cache: in
+   v2 a hot key deep in its chain is slow on every lookup, and readers of
+   hot keys pile up on the same buckets. */
+static void test_latency(void)
+{
+	zipf_init(&latency_zipf, (uint64_t) arguments.threads * arguments.size, 0.99);
+
+	hash_table_v2 = hash_table_v2_create();
+	run_threads(run_v2);
+	latency_table = hash_table_v2;
+	latency_contains = contains_v2;
+	test_lookup_latency("v2", false);
+	test_lookup_latency("v2", true);
+	hash_table_v2_destroy(hash_table_v2);
+
+	hash_table_cuckoo = hash_table_cuckoo_create();
+	run_threads(run_cuckoo);
+	latency_table = hash_table_cuckoo;
+	latency_contains = contains_cuckoo;
+	test_lookup_latency("cuckoo", false);
+	test_lookup_latency("cuckoo", true);
+	hash_table_cuckoo_destroy(hash_table_cuckoo);
+}
+
+/* Reports how fast a hash function is on its own, how evenly it spreads the
+   keys over `HASH_TABLE_CAPACITY` buckets, and how fast v2 is using it. */
+static void test_hash(enum hash_function hash_function)
+{
+	const char *name = get_hash_function_name(hash_function);
+	hash_function_t hash = get_hash_function(hash_function);
+	size_t count = (size_t) arguments.threads * arguments.size;
+	uint32_t *chains = calloc(HASH_TABLE_CAPACITY, sizeof(uint32_t));
+	struct timeval start, end;
+
+	gettimeofday(&start, NULL);
+	uint32_t combined = 0;
+	for (size_t i = 0; i < count; ++i) {
+		combined ^= hash(get_string(i));
+	}
+	gettimeofday(&end, NULL);
+	unsigned long usec = usec_diff(&start, &end);
+	printf("Hash %s: %'lu usec (%08x)\n", name, usec, combined);
+	printf("  - %'lu keys/sec\n", usec == 0 ? 0 : count * 1000000 / usec);
+
+	for (size_t i = 0; i < count; ++i) {
+		++chains[hash(get_string(i)) % HASH_TABLE_CAPACITY];
+	}
+	qsort(chains, HASH_TABLE_CAPACITY, sizeof(uint32_t), compare_uint32);
+	size_t empty = 0;
+	double sum_squares = 0;
+	for (size_t i = 0; i < HASH_TABLE_CAPACITY; ++i) {
+		empty += chains[i] == 0;
+		sum_squares += (double) chains[i] * chains[i];
+	}
+	double mean = (double) count / HASH_TABLE_CAPACITY;
+	double variance = sum_squares / HASH_TABLE_CAPACITY - mean * mean;
+	printf("  - chains: mean %.1f, stddev %.1f, p50 %u, p99 %u, max %u, %'lu empty\n",
+	       mean, sqrt(variance),
+	       chains[HASH_TABLE_CAPACITY / 2],
+	       chains[HASH_TABLE_CAPACITY * 99 / 100],
+	       chains[HASH_TABLE_CAPACITY - 1],
+	       empty);
+	free(chains);
+
+	struct hash_table_v2_options options = { .hash = hash_function };
+	char table_name[64];
+	snprintf(table_name, sizeof(table_name), "v2 (%s)", name);
+	test_v2(table_name, &options);
+}
+
+/* Runs the locked v2 benchmarks with a lock layout. Run with different `-t`
+   to see how each layout scales. */
+static void test_lock(enum hash_table_v2_lock lock)
+{
+	struct hash_table_v2_options options = { .lock = lock };
+	char table_name[64];
+	snprintf(table_name, sizeof(table_name), "v2 (%s locks)", hash_table_v2_lock_name(lock));
+	test_v2(table_name, &options);
+	if (arguments.mixed) {
+		test_v2_mixed(table_name, &options);
+	}
+	if (arguments.churn != 0) {
+		test_v2_churn(table_name, &options);
+	}
+}
+
+int main(int argc, char *argv[]) {
+	arguments.threads = 4;
+	arguments.size = 25000;
+	arguments.seed = 42;
+  
+	// static struct argp argp = { options, parse_opt };
+	static struct argp argp = { 0 };
+	argp.options = options;
+	argp.parser = parse_opt;
+	argp_parse(&argp, argc, argv, 0, 0, &arguments);
+
+	setlocale(LC_ALL, "en_US.UTF-8");
+
+	/* Not `calloc`, each slice is first touched by `run_generate` on the CPU
+	   its thread stays pinned to, see `run_threads`. */
+	data = malloc((size_t) arguments.threads * arguments.size * BYTES_PER_STRING);
+	threads = calloc(arguments.threads, sizeof(pthread_t));
+	get_cpus();
+
+	struct timeval start, end;
+
+	printf("Generation: %'lu usec\n", run_threads(run_generate));
+
+	test_allocation();
+
+	struct hash_table_base *hash_table_base = hash_table_base_create();
+	gettimeofday(&start, NULL);
+	for (uint32_t i = 0; i < arguments.threads; ++i) {
+		for (uint32_t j = 0; j < arguments.size; ++j) {
+			size_t global_index = get_global_index(i, j);
+			char *string = get_string(global_index);
+			hash_table_base_add_entry(hash_table_base, string, global_index);
+		}
+	}
+	gettimeofday(&end, NULL);
+	printf("Hash table base: %'lu usec\n", usec_diff(&start, &end));
+
+	size_t missing = 0;
+	for (uint32_t i = 0; i < arguments.threads; ++i) {
+		for (uint32_t j = 0; j < arguments.size; ++j) {
+			size_t global_index = get_global_index(i, j);
+			char *string = get_string(global_index);
+			if (!hash_table_base_contains(hash_table_base, string)) {
+				++missing;
+			}
+		}
+	}
+	printf("  - %'lu missing\n", missing);
+	PRINT_RSS_AND_DESTROY(hash_table_base_destroy, hash_table_base);
+
+	struct hash_table_v3 *hash_table_v3 = hash_table_v3_create();
+	gettimeofday(&start, NULL);
+	for (uint32_t i = 0; i < arguments.threads; ++i) {
+		for (uint32_t j = 0; j < arguments.size; ++j) {
+			size_t global_index = get_global_index(i, j);
+			char *string = get_string(global_index);
+			hash_table_v3_add_entry(hash_table_v3, string, global_index);
+		}
+	}
+	gettimeofday(&end, NULL);
+	printf("Hash table v3: %'lu usec\n", usec_diff(&start, &end));
+
+	missing = 0;
+	for (uint32_t i = 0; i < arguments.threads; ++i) {
+		for (uint32_t j = 0; j < arguments.size; ++j) {
+			size_t global_index = get_global_index(i, j);
+			char *string = get_string(global_index);
+			if (!hash_table_v3_contains(hash_table_v3, string)) {
+				++missing;
+			}
+		}
+	}
+	printf("  - %'lu missing\n", missing);
+	hash_table_v3_destroy(hash_table_v3);
+
+	test_generic();
+
+	run_swiss(HASH_TABLE_SWISS_ENGINE_AUTO);
+	run_swiss(HASH_TABLE_SWISS_ENGINE_SCALAR);
+
+	test_v1("v1", NULL);
+
+	struct hash_table_v1_options optimistic_options = { .optimistic = true };
+	test_v1("v1 (optimistic)", &optimistic_options);
+
+	test_v2("v2", NULL);
+
+	struct hash_table_v2_options lock_free_options = { .lock_free = true };
+	test_v2("v2 (lock-free)", &lock_free_options);
+
+	struct hash_table_v2_options own_keys_options = { .own_keys = true };
+	test_v2("v2 (owned keys)", &own_keys_options);
+
+	/* Every key is `BYTES_PER_STRING` bytes including its terminator. */
+	struct hash_table_v2_options fixed_width_options = { .key_width = BYTES_PER_STRING };
+	test_v2("v2 (fixed width keys)", &fixed_width_options);
+
+	/* A flush only shares a lock between keys that land on it, so the
+	   buffer holds about four keys per bucket, and with 64 stripes about 64
+	   keys per stripe. */
+	struct hash_table_v2_options buffer_options = { .insert_buffer = 4 * HASH_TABLE_CAPACITY };
+	test_v2("v2 (insert buffer)", &buffer_options);
+
+	struct hash_table_v2_options striped_buffer_options = {
+		.lock = HASH_TABLE_V2_LOCK_STRIPED,
+		.insert_buffer = HASH_TABLE_CAPACITY,
+	};
+	test_v2("v2 (striped, insert buffer)", &striped_buffer_options);
+
+	if (arguments.mixed) {
+		test_v2_mixed("v2", NULL);
+		test_v2_mixed("v2 (lock-free)", &lock_free_options);
+	}
+
+	test_sharded();
+
+	test_foreach();
+
+	if (arguments.words != 0) {
+		if (arguments.words > arguments.threads * arguments.size) {
+			exit(EINVAL);
+		}
+		test_v2_word_count("v2", NULL, true);
+		test_v2_word_count("v2", NULL, false);
+		test_v2_word_count("v2 (lock-free)", &lock_free_options, false);
+	}
+
+	if (arguments.misses) {
+		/* Sized for the keys that are inserted. */
+		struct hash_table_v2_options filter_options = {
+			.filter_capacity = (size_t) arguments.threads * arguments.size
+			                   * (100 - arguments.miss_ratio) / 100 + 1,
+		};
+		test_v2_misses("v2", NULL);
+		test_v2_misses("v2 (filter)", &filter_options);
+	}
+
+	if (arguments.snapshot != NULL) {
+		test_snapshot();
+	}
+
+	if (arguments.churn != 0) {
+		test_v2_churn("v2", NULL);
+		test_v2_churn("v2 (lock-free)", &lock_free_options);
+	}
+
+	if (arguments.batch != 0) {
+		test_v2_batched("v2", NULL);
+		test_v2_batched("v2 (lock-free)", &lock_free_options);
+	}
+
+	if (arguments.compare_hashes) {
+		for (int i = 0; i < HASH_FUNCTION_COUNT; ++i) {
+			if (arguments.all_hashes || (enum hash_function) i == arguments.hash) {
+				test_hash(i);
+			}
+		}
+	}
+
+	if (arguments.compare_locks) {
+		for (int i = 0; i < HASH_TABLE_V2_LOCK_COUNT; ++i) {
+			if (arguments.all_locks || (enum hash_table_v2_lock) i == arguments.lock) {
+				test_lock(i);
+			}
+		}
+	}
+
+	hash_table_resizable = hash_table_resizable_create();
+	printf("Hash table resizable: %'lu usec\n", run_threads(run_resizable));
+
+	missing = 0;
+	for (uint32_t i = 0; i < arguments.threads; ++i) {
+		for (uint32_t j = 0; j < arguments.size; ++j) {
+			size_t global_index = get_global_index(i, j);
+			char *string = get_string(global_index);
+			if (!hash_table_resizable_contains(hash_table_resizable, string)) {
+				++missing;
+			}
+		}
+	}
+	printf("  - %'lu missing\n", missing);
+	printf("  - %'lu buckets\n", hash_table_resizable_capacity(hash_table_resizable));
+	hash_table_resizable_destroy(hash_table_resizable);
+
+	hash_table_cuckoo = hash_table_cuckoo_create();
+	printf("Hash table cuckoo: %'lu usec\n", run_threads(run_cuckoo));
+
+	missing = 0;
+	for (uint32_t i = 0; i < arguments.threads; ++i) {
+		for (uint32_t j = 0; j < arguments.size; ++j) {
+			size_t global_index = get_global_index(i, j);
+			char *string = get_string(global_index);
+			if (!hash_table_cuckoo_contains(hash_table_cuckoo, string)) {
+				++missing;
+			}
+		}
+	}
+	printf("  - %'lu missing\n", missing);
+	printf("  - %'lu slots\n", hash_table_cuckoo_capacity(hash_table_cuckoo));
+	PRINT_RSS_AND_DESTROY(hash_table_cuckoo_destroy, hash_table_cuckoo);
+
+	if (arguments.latency) {
+		test_latency();
+	}
+
+	test_skip_list();
 
 	free(threads);
 	free(data);
@@ -0,0 +1,212 @@
+#include "skip-list.h"
+
+#include <assert.h>
+#include <stdlib.h>
+#include <string.h>
+
+/* A node is on level `i` with probability 4^-i, so the top level is only
+   reached by about one in a billion nodes. */
+#define SKIP_LIST_MAX_HEIGHT 16
+
+struct skip_list_node {
+	const char *key;
+	uint32_t value;
+	uint32_t height;
+	/* `next[i]` is the next node on level `i`. Level 0 links every node,
+	   each higher level skips about three quarters of the one below. */
+	struct skip_list_node *next[];
+};
+
+struct skip_list {
+	/* A node without a key that comes before every other, with every
+	   level. */
+	struct skip_list_node *head;
+};
+
+/* Every thread picks node heights from its own xorshift64 state, so inserts
+   don't contend on a shared generator. */
+static __thread uint64_t random_state;
+
+static uint32_t get_random_height(void)
+{
+	uint64_t x = random_state;
+	if (x == 0) {
+		x = ((uintptr_t) &random_state * 0x9E3779B97F4A7C15ull) | 1;
+	}
+	x ^= x << 13;
+	x ^= x >> 7;
+	x ^= x << 17;
+	random_state = x;
+
+	uint32_t height = 1;
+	while (height < SKIP_LIST_MAX_HEIGHT && (x & 3) == 0) {
+		++height;
+		x >>= 2;
+	}
+	return height;
+}
+
+static struct skip_list_node *create_node(const char *key, uint32_t value, uint32_t height)
+{
+	struct skip_list_node *node = calloc(1, sizeof(struct skip_list_node)
+	                                        + height * sizeof(struct skip_list_node *));
+	assert(node != NULL);
+	node->key = key;
+	node->value = value;
+	node->height = height;
+	return node;
+}
+
+struct skip_list *skip_list_create()
+{
+	struct skip_list *skip_list = calloc(1, sizeof(struct skip_list));
+	assert(skip_list != NULL);
+	skip_list->head = create_node(NULL, 0, SKIP_LIST_MAX_HEIGHT);
+	return skip_list;
+}
+
+/* Finds, on every level, the last node before `key` and the node after it.
+   Returns whether the level 0 successor is `key` itself. The links are
+   loaded with acquire semantics so a node linked by another thread is fully
+   initialized by the time we read its key. */
+static bool find(struct skip_list *skip_list,
+                 const char *key,
+                 struct skip_list_node *preds[SKIP_LIST_MAX_HEIGHT],
+                 struct skip_list_node *succs[SKIP_LIST_MAX_HEIGHT])
+{
+	struct skip_list_node *pred = skip_list->head;
+	int cmp = 1;
+	for (int level = SKIP_LIST_MAX_HEIGHT - 1; level >= 0; --level) {
+		struct skip_list_node *curr = __atomic_load_n(&pred->next[level], __ATOMIC_ACQUIRE);
+		while (curr != NULL && (cmp = strcmp(curr->key, key)) < 0) {
+			pred = curr;
+			curr = __atomic_load_n(&curr->next[level], __ATOMIC_ACQUIRE);
+		}
+		if (curr == NULL) {
+			cmp = 1;
+		}
+		preds[level] = pred;
+		succs[level] = curr;
+	}
+	return cmp == 0;
+}
+
+/* The node is in the list once it's linked on level 0, the higher levels are
+   only shortcuts. Each level is linked with a CAS from its predecessor, and
+   if another insert changed that link first we search again for the new
+   neighbours. Nodes are never unlinked, so a predecessor stays valid and
+   there is no ABA. */
+void skip_list_add_entry(struct skip_list *skip_list,
+                         const char *key,
+                         uint32_t value)
+{
+	assert(key != NULL);
+	struct skip_list_node *preds[SKIP_LIST_MAX_HEIGHT];
+	struct skip_list_node *succs[SKIP_LIST_MAX_HEIGHT];
+	struct skip_list_node *node = NULL;
+
+	while (true) {
+		/* Update the value if it already exists */
+		if (find(skip_list, key, preds, succs)) {
+			__atomic_store_n(&succs[0]->value, value, __ATOMIC_RELAXED);
+			free(node);
+			return;
+		}
+		if (node == NULL) {
+			node = create_node(key, value, get_random_height());
+		}
+		for (uint32_t level = 0; level < node->height; ++level) {
+			__atomic_store_n(&node->next[level], succs[level], __ATOMIC_RELAXED);
+		}
+		struct skip_list_node *expected = succs[0];
+		if (__atomic_compare_exchange_n(&preds[0]->next[0], &expected, node,
+		                                false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+			break;
+		}
+	}
+
+	for (uint32_t level = 1; level < node->height; ++level) {
+		while (true) {
+			/* Nobody can reach `node` on this level yet, so its link can
+			   still change. It has to match what the CAS expects: a later
+			   `find` may have moved `succs[level]` past a node linked in the
+			   meantime, which the link from the first `find` would skip. */
+			struct skip_list_node *expected = succs[level];
+			__atomic_store_n(&node->next[level], expected, __ATOMIC_RELAXED);
+			if (__atomic_compare_exchange_n(&preds[level]->next[level], &expected, node,
+			                                false, __ATOMIC_RELEASE, __ATOMIC_RELAXED)) {
+				break;
+			}
+			find(skip_list, key, preds, succs);
+		}
+	}
+}
+
+static struct skip_list_node *get_node(struct skip_list *skip_list, const char *key)
+{
+	assert(key != NULL);
+	struct skip_list_node *pred = skip_list->head;
+	for (int level = SKIP_LIST_MAX_HEIGHT - 1; level >= 0; --level) {
+		struct skip_list_node *curr = __atomic_load_n(&pred->next[level], __ATOMIC_ACQUIRE);
+		while (curr != NULL) {
+			int cmp = strcmp(curr->key, key);
+			if (cmp == 0) {
+				return curr;
+			}
+			if (cmp > 0) {
+				break;
+			}
+			pred = curr;
+			curr = __atomic_load_n(&curr->next[level], __ATOMIC_ACQUIRE);
+		}
+	}
+	return NULL;
+}
+
+bool skip_list_contains(struct skip_list *skip_list,
+                        const char *key)
+{
+	return get_node(skip_list, key) != NULL;
+}
+
+uint32_t skip_list_get_value(struct skip_list *skip_list,
+                             const char *key)
+{
+	struct skip_list_node *node = get_node(skip_list, key);
+	assert(node != NULL);
+	return __atomic_load_n(&node->value, __ATOMIC_RELAXED);
+}
+
+void skip_list_range(struct skip_list *skip_list,
+                     const char *low,
+                     const char *high,
+                     void (*function)(const char *key, uint32_t value, void *context),
+                     void *context)
+{
+	struct skip_list_node *node;
+	if (low == NULL) {
+		node = __atomic_load_n(&skip_list->head->next[0], __ATOMIC_ACQUIRE);
+	}
+	else {
+		struct skip_list_node *preds[SKIP_LIST_MAX_HEIGHT];
+		struct skip_list_node *succs[SKIP_LIST_MAX_HEIGHT];
+		find(skip_list, low, preds, succs);
+		node = succs[0];
+	}
+	while (node != NULL && (high == NULL || strcmp(node->key, high) < 0)) {
+		function(node->key, __atomic_load_n(&node->value, __ATOMIC_RELAXED), context);
+		node = __atomic_load_n(&node->next[0], __ATOMIC_ACQUIRE);
+	}
+}
+
+void skip_list_destroy(struct skip_list *skip_list)
+{
+	/* Every node is on level 0. */
+	struct skip_list_node *node = skip_list->head;
+	while (node != NULL) {
+		struct skip_list_node *next = node->next[0];
+		free(node);
+		node = next;
+	}
+	free(skip_list);
+}
@@ -0,0 +1,32 @@
+#pragma once
+
+#include <stdbool.h>
+#include <stdint.h>
+
+/* A lock-free skip list, ordered by `strcmp`, with the same calls as the
+   hash tables plus `skip_list_range`. Every call is safe to make
+   concurrently with every other one: inserts link their node with a CAS
+   per level and lookups never wait. There is no remove, which is what keeps
+   it simple: a node is never unlinked, so nothing has to be reclaimed while
+   other threads may be reading it.
+
+   Like v2 by default, the list keeps the caller's key pointers, so keys
+   must outlive the list. */
+struct skip_list;
+struct skip_list *skip_list_create();
+void skip_list_add_entry(struct skip_list *skip_list,
+                         const char *key,
+                         uint32_t value);
+bool skip_list_contains(struct skip_list *skip_list,
+                        const char *key);
+uint32_t skip_list_get_value(struct skip_list *skip_list,
+                             const char *key);
+/* Calls `function` for every key in [`low`, `high`) in order, `NULL` for
+   either leaves that end open. A prefix scan for "ab" is the range ["ab",
+   "ac"). Keys inserted during the walk may or may not be seen. */
+void skip_list_range(struct skip_list *skip_list,
+                     const char *low,
+                     const char *high,
+                     void (*function)(const char *key, uint32_t value, void *context),
+                     void *context);
+void skip_list_destroy(struct skip_list *skip_list);